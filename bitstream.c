@@ -0,0 +1,278 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ice40.h"
+#include "bitstream.h"
+
+static const char *bitstream_record_names[] = {
+    [BR_CRAM] = "cram",
+    [BR_BRAM] = "bram",
+    [BR_CRC_RESET] = "crc reset",
+    [BR_CRC_CHECK] = "crc check",
+    [BR_WAKEUP] = "wakeup",
+};
+
+static struct bitstream_record *bitstream_add(struct bitstream *bs,
+                                              enum bitstream_record_type type,
+                                              uint32_t command, uint32_t data) {
+    struct bitstream_record *grown;
+
+    // Start with room for 16 records, then double
+    if (!bs->count || ((bs->count >= 16) && !(bs->count & (bs->count - 1)))) {
+        grown = realloc(bs->records, (bs->count ? bs->count * 2 : 16) * sizeof(*grown));
+        if (!grown) {
+            perror("unable to allocate bitstream index");
+            return NULL;
+        }
+        bs->records = grown;
+    }
+    grown = &bs->records[bs->count++];
+    memset(grown, 0, sizeof(*grown));
+    grown->type = type;
+    grown->command = command;
+    grown->data = data;
+    return grown;
+}
+
+static int bitstream_index(struct bitstream *bs) {
+    const uint8_t *d = bs->data;
+    size_t len = bs->length;
+    size_t pos;
+    uint32_t preamble = 0;
+    uint32_t bank = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t offset = 0;
+
+    for (pos = 0; pos < len; pos++) {
+        preamble = (preamble << 8) | d[pos];
+        if (preamble == 0x7eaa997e)
+            break;
+    }
+    if (pos >= len) {
+        fprintf(stderr, "bitstream: no preamble found\n");
+        return -1;
+    }
+    bs->preamble = ++pos;
+
+    while (pos < len) {
+        struct bitstream_record *rec;
+        uint32_t command = pos;
+        uint8_t cmd = d[pos] >> 4;
+        uint8_t payload_len = d[pos] & 0xf;
+        uint32_t payload = 0;
+        unsigned int i;
+
+        if (pos + 1 + payload_len > len)
+            break;
+        for (i = 0; i < payload_len; i++)
+            payload = (payload << 8) | d[pos + 1 + i];
+        pos += 1 + payload_len;
+
+        switch (cmd) {
+        case 0:
+            switch (payload) {
+            case 1:
+            case 3:
+                rec = bitstream_add(bs, (payload == 1) ? BR_CRAM : BR_BRAM, command, pos);
+                if (!rec)
+                    return -1;
+                rec->length = (width * height) / 8;
+                rec->bank = bank;
+                rec->width = width;
+                rec->height = height;
+                rec->offset = offset;
+
+                // Every block of data is followed by two zero bytes
+                if (pos + rec->length + 2 > len) {
+                    fprintf(stderr, "bitstream: %s block at 0x%x runs past the end\n",
+                            bitstream_record_names[rec->type], command);
+                    return -1;
+                }
+                pos += rec->length + 2;
+                break;
+
+            case 5:
+                if (!bitstream_add(bs, BR_CRC_RESET, command, pos))
+                    return -1;
+                break;
+
+            case 6:
+                return bitstream_add(bs, BR_WAKEUP, command, pos) ? 0 : -1;
+
+            default:
+                break;
+            }
+            break;
+
+        case 1:
+            bank = payload;
+            break;
+
+        // The CRC16 is the payload itself
+        case 2:
+            if (payload_len != 2)
+                break;
+            if (!bitstream_add(bs, BR_CRC_CHECK, command, command + 1))
+                return -1;
+            break;
+
+        case 5:
+            bs->frequency_range = payload;
+            break;
+
+        case 6:
+            width = payload + 1;
+            break;
+
+        case 7:
+            height = payload;
+            break;
+
+        case 8:
+            offset = payload;
+            break;
+
+        case 9:
+            bs->warmboot = !!(payload & 0x20);
+            bs->nosleep = !!(payload & 0x01);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    fprintf(stderr, "bitstream: ends without a wakeup command\n");
+    return -1;
+}
+
+struct bitstream *bitstreamParse(const uint8_t *data, size_t length) {
+    struct bitstream *bs = calloc(1, sizeof(*bs));
+
+    if (!bs) {
+        perror("unable to allocate bitstream index");
+        return NULL;
+    }
+    bs->data = data;
+    bs->length = length;
+    if (bitstream_index(bs)) {
+        bitstreamClose(&bs);
+        return NULL;
+    }
+    return bs;
+}
+
+struct bitstream *bitstreamOpen(const char *path) {
+    struct bitstream *bs;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    if (!st.st_size) {
+        fprintf(stderr, "%s: empty bitstream\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid once the file is closed
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    bs = bitstreamParse(data, st.st_size);
+    if (!bs) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    bs->mapped = 1;
+    return bs;
+}
+
+void bitstreamClose(struct bitstream **bs) {
+    if (!bs || !*bs)
+        return;
+    if ((*bs)->mapped)
+        munmap((void *)(*bs)->data, (*bs)->length);
+    free((*bs)->records);
+    free(*bs);
+    *bs = NULL;
+}
+
+const struct bitstream_record *bitstreamFind(const struct bitstream *bs,
+                                             enum bitstream_record_type type,
+                                             int bank, int n) {
+    int i;
+
+    for (i = 0; i < bs->count; i++) {
+        const struct bitstream_record *rec = &bs->records[i];
+        if (rec->type != type)
+            continue;
+        if ((bank != -1) && ((type == BR_CRAM) || (type == BR_BRAM)) && (rec->bank != (uint32_t)bank))
+            continue;
+        if (!n--)
+            return rec;
+    }
+    return NULL;
+}
+
+int bitstreamCheckCrc(const struct bitstream *bs, FILE *stream) {
+    uint32_t start = bs->preamble;
+    int errors = 0;
+    int i;
+
+    for (i = 0; i < bs->count; i++) {
+        const struct bitstream_record *rec = &bs->records[i];
+        if (rec->type == BR_CRC_RESET)
+            start = rec->data;
+        else if (rec->type == BR_CRC_CHECK) {
+            // The check command byte itself is covered, its payload isn't
+            uint16_t expected = (bs->data[rec->data] << 8) | bs->data[rec->data + 1];
+            uint16_t crc = ice40_crc16(0xffff, bs->data + start, rec->data - start);
+            if (crc != expected) {
+                if (stream)
+                    fprintf(stream, "crc check at 0x%x: expected %04x, got %04x\n",
+                            rec->command, expected, crc);
+                errors++;
+            }
+        }
+    }
+    return errors;
+}
+
+void bitstreamPrint(FILE *stream, const struct bitstream *bs) {
+    int i;
+
+    fprintf(stream, "%zu bytes, commands start at 0x%x, frequency range %u%s%s\n",
+            bs->length, bs->preamble, bs->frequency_range,
+            bs->warmboot ? ", warmboot" : "", bs->nosleep ? ", nosleep" : "");
+    for (i = 0; i < bs->count; i++) {
+        const struct bitstream_record *rec = &bs->records[i];
+        fprintf(stream, "0x%08x %s", rec->command, bitstream_record_names[rec->type]);
+        if ((rec->type == BR_CRAM) || (rec->type == BR_BRAM))
+            fprintf(stream, " (bank %u): %u x %u @ 0x%04x, %u bytes at 0x%08x",
+                    rec->bank, rec->width, rec->height, rec->offset, rec->length, rec->data);
+        else if (rec->type == BR_CRC_CHECK)
+            fprintf(stream, " %02x%02x", bs->data[rec->data], bs->data[rec->data + 1]);
+        fprintf(stream, "\n");
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef FF_BITSTREAM_H_
+#define FF_BITSTREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// An index of the commands in an iCE40 bitstream, so the CRAM and BRAM
+// blocks in it can be found without walking the stream again.
+
+enum bitstream_record_type {
+    BR_CRAM,            // CRAM data for one bank
+    BR_BRAM,            // BRAM data for one bank
+    BR_CRC_RESET,       // CRC reset; the CRC covers everything after this
+    BR_CRC_CHECK,       // CRC check; `data` points to the expected CRC16
+    BR_WAKEUP,          // Wakeup; the FPGA starts once it gets here
+};
+
+struct bitstream_record {
+    enum bitstream_record_type type;
+    uint32_t command;   // Offset of the command in the file
+    uint32_t data;      // Offset of the data (or CRC16) that follows it
+    uint32_t length;    // Bytes of data, not counting the trailing 0x0000
+    uint32_t bank;
+    uint32_t width;
+    uint32_t height;
+    uint32_t offset;    // Offset the block is loaded at within its bank
+};
+
+struct bitstream {
+    const uint8_t *data;
+    size_t length;
+    uint32_t preamble;  // Offset of the first command after the preamble
+    uint32_t frequency_range;
+    int warmboot;
+    int nosleep;
+    int count;
+    struct bitstream_record *records;
+    int mapped;
+};
+
+// Map a bitstream file and index it.  Returns NULL if the file can't be
+// read or isn't a complete bitstream.
+struct bitstream *bitstreamOpen(const char *path);
+
+// Index a bitstream that's already in memory.  `data` must outlive the
+// index, and isn't freed with it.
+struct bitstream *bitstreamParse(const uint8_t *data, size_t length);
+
+void bitstreamClose(struct bitstream **bs);
+
+// Find the `n`th record of a type, counting from 0.  For CRAM and BRAM,
+// only blocks in `bank` are counted, unless it is -1.  Returns NULL if
+// there are no more.
+const struct bitstream_record *bitstreamFind(const struct bitstream *bs,
+                                             enum bitstream_record_type type,
+                                             int bank, int n);
+
+// Check every CRC16 in the bitstream against its data.  Returns the
+// number of mismatches, each of which is reported on `stream` if given.
+int bitstreamCheckCrc(const struct bitstream *bs, FILE *stream);
+
+void bitstreamPrint(FILE *stream, const struct bitstream *bs);
+
+#endif /* FF_BITSTREAM_H_ */
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ice40.h"
+#include "brammap.h"
+
+static int brammap_parse_line(const char *line, struct ice40_bram_map *map) {
+    const char *p;
+    char *end;
+    int i;
+
+    memset(map, 0, sizeof(*map));
+    map->bank = strtoul(line, &end, 0);
+    if (end == line)
+        return -1;
+    p = end;
+    map->offset = strtoul(p, &end, 0);
+    if (end == p)
+        return -1;
+    p = end;
+    map->rom = strtol(p, &end, 0);
+    if (end == p)
+        return -1;
+    p = end;
+    map->base = strtoul(p, &end, 0);
+    if (end == p)
+        return -1;
+    p = end;
+    map->stride = strtol(p, &end, 0);
+    if ((end == p) || (map->stride < 1) || (map->stride > ICE40_BRAM_LANES))
+        return -1;
+    p = end;
+
+    for (i = 0; i < ICE40_BRAM_LANES; i++)
+        map->lane[i] = -1;
+    for (i = 0; i < map->stride; i++) {
+        map->lane[i] = strtol(p, &end, 0);
+        if ((end == p) || (map->lane[i] < -1) || (map->lane[i] >= 16))
+            return -1;
+        p = end;
+        if ((i < map->stride - 1) && (*p++ != ','))
+            return -1;
+    }
+    while ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n'))
+        p++;
+    return *p ? -1 : 0;
+}
+
+int bramMapLoad(const char *path, struct ice40_bram_map **maps, int *count) {
+    char line[512];
+    int line_number = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    *maps = NULL;
+    *count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        struct ice40_bram_map *grown;
+        char *p = line;
+
+        line_number++;
+        while ((*p == ' ') || (*p == '\t'))
+            p++;
+        if ((*p == '#') || (*p == '\n') || (*p == '\r') || !*p)
+            continue;
+
+        grown = realloc(*maps, (*count + 1) * sizeof(**maps));
+        if (!grown) {
+            perror("unable to allocate bram map");
+            goto err;
+        }
+        *maps = grown;
+        if (brammap_parse_line(p, &(*maps)[*count])) {
+            fprintf(stderr, "%s:%d: expected \"bank offset rom word stride lanes\"\n",
+                    path, line_number);
+            goto err;
+        }
+        (*count)++;
+    }
+    fclose(f);
+    if (!*count) {
+        fprintf(stderr, "%s: no blocks in bram map\n", path);
+        return -1;
+    }
+    return 0;
+
+err:
+    fclose(f);
+    free(*maps);
+    *maps = NULL;
+    *count = 0;
+    return -1;
+}
+
+int bramMapSave(const char *path, const struct ice40_bram_map *maps, int count) {
+    int i, j;
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "# bank offset rom word stride lanes\n");
+    for (i = 0; i < count; i++) {
+        fprintf(f, "%u 0x%04x %d %u %d ", maps[i].bank, maps[i].offset,
+                maps[i].rom, maps[i].base, maps[i].stride);
+        for (j = 0; j < maps[i].stride; j++)
+            fprintf(f, "%s%d", j ? "," : "", maps[i].lane[j]);
+        fprintf(f, "\n");
+    }
+    if (fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef FF_BRAMMAP_H_
+#define FF_BRAMMAP_H_
+
+struct ice40_bram_map;
+
+// A BRAM map lists, one block per line, where ROMs sit in a bitstream:
+//
+//     # bank offset rom word stride lanes
+//     0 0x0000 0 0 16 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+//
+// `rom` counts the -l options from 0.  See struct ice40_bram_map for
+// what the other fields mean.
+
+// Read a map into a newly allocated array.  Returns 0 on success.
+int bramMapLoad(const char *path, struct ice40_bram_map **maps, int *count);
+
+// Write a map, e.g. one recorded by ice40_patch_record().  Returns 0 on
+// success.
+int bramMapSave(const char *path, const struct ice40_bram_map *maps, int count);
+
+#endif /* FF_BRAMMAP_H_ */
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+static int cache_mkdirs(char *path) {
+    char *p;
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if ((mkdir(path, 0755) == -1) && (errno != EEXIST)) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    if ((mkdir(path, 0755) == -1) && (errno != EEXIST))
+        return -1;
+    return 0;
+}
+
+int cacheDir(const char *dir, char *out, size_t out_len) {
+    const char *env;
+    int len;
+
+    if (dir)
+        len = snprintf(out, out_len, "%s", dir);
+    else if ((env = getenv("FOMU_FLASH_CACHE")) != NULL)
+        len = snprintf(out, out_len, "%s", env);
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL)
+        len = snprintf(out, out_len, "%s/fomu-flash", env);
+    else if ((env = getenv("HOME")) != NULL)
+        len = snprintf(out, out_len, "%s/.cache/fomu-flash", env);
+    else {
+        fprintf(stderr, "no cache directory -- set FOMU_FLASH_CACHE\n");
+        return -1;
+    }
+    if ((len < 0) || ((size_t)len >= out_len)) {
+        fprintf(stderr, "cache directory path is too long\n");
+        return -1;
+    }
+
+    if (cache_mkdirs(out) == -1) {
+        perror("unable to create cache directory");
+        return -1;
+    }
+    return 0;
+}
+
+int cacheWriteFile(const char *path, const void *data, size_t len) {
+    char tmp[4096];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("unable to create cache file");
+        return -1;
+    }
+    if ((write(fd, data, len) != (ssize_t)len) || (fsync(fd) == -1)) {
+        perror("unable to write cache file");
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, path) == -1) {
+        perror("unable to rename cache file");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
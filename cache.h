@@ -0,0 +1,15 @@
+#ifndef FF_CACHE_H_
+#define FF_CACHE_H_
+
+#include <stddef.h>
+
+// Resolve (and create) a fomu-flash cache directory.  If `dir` is NULL
+// it defaults to $FOMU_FLASH_CACHE, $XDG_CACHE_HOME/fomu-flash or
+// ~/.cache/fomu-flash, in that order.  Returns 0 on success.
+int cacheDir(const char *dir, char *out, size_t out_len);
+
+// Atomically replace `path` with `len` bytes of `data` (write to a
+// temporary file, fsync, then rename).  Returns 0 on success.
+int cacheWriteFile(const char *path, const void *data, size_t len);
+
+#endif /* FF_CACHE_H_ */
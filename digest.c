@@ -0,0 +1,295 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "digest.h"
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void) {
+    uint32_t i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        crc32_table[i] = c;
+    }
+}
+
+uint32_t digestCrc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    if (!crc32_table[1])
+        crc32_init();
+
+    crc = ~crc;
+    while (len--)
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Multiply a 32x32 matrix over GF(2), one column per word, by a vector
+static uint32_t crc32_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void crc32_matrix_square(uint32_t *square, const uint32_t *mat) {
+    int i;
+    for (i = 0; i < 32; i++)
+        square[i] = crc32_matrix_times(mat, mat[i]);
+}
+
+uint32_t digestCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32];
+    uint32_t odd[32];
+    uint32_t row = 1;
+    int i;
+
+    if (!len2)
+        return crc1;
+
+    // The operator for one zero bit, then for two and four
+    odd[0] = 0xedb88320;
+    for (i = 1; i < 32; i++) {
+        odd[i] = row;
+        row <<= 1;
+    }
+    crc32_matrix_square(even, odd);
+    crc32_matrix_square(odd, even);
+
+    // Apply len2 zero bytes to crc1, squaring up through the bits of len2
+    do {
+        crc32_matrix_square(even, odd);
+        if (len2 & 1)
+            crc1 = crc32_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (!len2)
+            break;
+        crc32_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = crc32_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
+#define XXH32_PRIME1 0x9e3779b1
+#define XXH32_PRIME2 0x85ebca77
+#define XXH32_PRIME3 0xc2b2ae3d
+#define XXH32_PRIME4 0x27d4eb2f
+#define XXH32_PRIME5 0x165667b1
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static uint32_t xxh32_get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t xxh32_round(uint32_t v, uint32_t input) {
+    v += input * XXH32_PRIME2;
+    return ROL32(v, 13) * XXH32_PRIME1;
+}
+
+static void xxh32_stripe(struct xxh32_ctx *ctx, const uint8_t *p) {
+    int i;
+    for (i = 0; i < 4; i++)
+        ctx->v[i] = xxh32_round(ctx->v[i], xxh32_get32(p + i * 4));
+}
+
+void digestXxh32Init(struct xxh32_ctx *ctx, uint32_t seed) {
+    ctx->v[0] = seed + XXH32_PRIME1 + XXH32_PRIME2;
+    ctx->v[1] = seed + XXH32_PRIME2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - XXH32_PRIME1;
+    ctx->seed = seed;
+    ctx->len = 0;
+    ctx->buf_len = 0;
+}
+
+void digestXxh32Update(struct xxh32_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    ctx->len += len;
+    if (ctx->buf_len) {
+        size_t n = sizeof(ctx->buf) - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < sizeof(ctx->buf))
+            return;
+        xxh32_stripe(ctx, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    while (len >= sizeof(ctx->buf)) {
+        xxh32_stripe(ctx, p);
+        p += sizeof(ctx->buf);
+        len -= sizeof(ctx->buf);
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+uint32_t digestXxh32Final(const struct xxh32_ctx *ctx) {
+    const uint8_t *p = ctx->buf;
+    uint32_t left = ctx->buf_len;
+    uint32_t h;
+
+    // Short inputs never fill a stripe, and only use the seed
+    if (ctx->len >= sizeof(ctx->buf))
+        h = ROL32(ctx->v[0], 1) + ROL32(ctx->v[1], 7) + ROL32(ctx->v[2], 12) + ROL32(ctx->v[3], 18);
+    else
+        h = ctx->seed + XXH32_PRIME5;
+    h += (uint32_t)ctx->len;
+
+    for (; left >= 4; p += 4, left -= 4) {
+        h += xxh32_get32(p) * XXH32_PRIME3;
+        h = ROL32(h, 17) * XXH32_PRIME4;
+    }
+    for (; left; p++, left--) {
+        h += *p * XXH32_PRIME5;
+        h = ROL32(h, 11) * XXH32_PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= XXH32_PRIME2;
+    h ^= h >> 13;
+    h *= XXH32_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t digestXxh32(const void *data, size_t len, uint32_t seed) {
+    struct xxh32_ctx ctx;
+    digestXxh32Init(&ctx, seed);
+    digestXxh32Update(&ctx, data, len);
+    return digestXxh32Final(&ctx);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256_ctx *ctx, const uint8_t *p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16)
+             | ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+    e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+    for (i = 0; i < 64; i++) {
+        uint32_t s1 = ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void digestSha256Init(struct sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->len = 0;
+    ctx->buf_len = 0;
+}
+
+void digestSha256Update(struct sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    ctx->len += len;
+    if (ctx->buf_len) {
+        size_t n = sizeof(ctx->buf) - ctx->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < sizeof(ctx->buf))
+            return;
+        sha256_block(ctx, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    while (len >= sizeof(ctx->buf)) {
+        sha256_block(ctx, p);
+        p += sizeof(ctx->buf);
+        len -= sizeof(ctx->buf);
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+void digestSha256Final(struct sha256_ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->len * 8;
+    int i;
+
+    ctx->buf[ctx->buf_len++] = 0x80;
+    if (ctx->buf_len > 56) {
+        memset(ctx->buf + ctx->buf_len, 0, sizeof(ctx->buf) - ctx->buf_len);
+        sha256_block(ctx, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+    for (i = 0; i < 8; i++)
+        ctx->buf[56 + i] = bits >> (56 - 8 * i);
+    sha256_block(ctx, ctx->buf);
+
+    for (i = 0; i < 8; i++) {
+        out[i * 4 + 0] = ctx->h[i] >> 24;
+        out[i * 4 + 1] = ctx->h[i] >> 16;
+        out[i * 4 + 2] = ctx->h[i] >> 8;
+        out[i * 4 + 3] = ctx->h[i];
+    }
+}
+
+void digestSha256(const void *data, size_t len, uint8_t out[SHA256_DIGEST_SIZE]) {
+    struct sha256_ctx ctx;
+    digestSha256Init(&ctx);
+    digestSha256Update(&ctx, data, len);
+    digestSha256Final(&ctx, out);
+}
+
+void digestToHex(const uint8_t *digest, size_t len, char *out) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        sprintf(out + i * 2, "%02x", digest[i]);
+    out[len * 2] = '\0';
+}
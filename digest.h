@@ -0,0 +1,47 @@
+#ifndef FF_DIGEST_H_
+#define FF_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+    uint32_t buf_len;
+};
+
+// zlib-compatible CRC32.  Start with crc = 0, and feed the previous
+// result back in to continue a running checksum.
+uint32_t digestCrc32(uint32_t crc, const void *data, size_t len);
+
+// The CRC32 of two buffers back to back, given the CRC32 of each and
+// the length of the second, like zlib's crc32_combine().
+uint32_t digestCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+struct xxh32_ctx {
+    uint32_t v[4];
+    uint32_t seed;
+    uint64_t len;
+    uint8_t buf[16];
+    uint32_t buf_len;
+};
+
+// xxHash32, as used for the checksums in LZ4 frames
+void digestXxh32Init(struct xxh32_ctx *ctx, uint32_t seed);
+void digestXxh32Update(struct xxh32_ctx *ctx, const void *data, size_t len);
+uint32_t digestXxh32Final(const struct xxh32_ctx *ctx);
+uint32_t digestXxh32(const void *data, size_t len, uint32_t seed);
+
+void digestSha256Init(struct sha256_ctx *ctx);
+void digestSha256Update(struct sha256_ctx *ctx, const void *data, size_t len);
+void digestSha256Final(struct sha256_ctx *ctx, uint8_t out[SHA256_DIGEST_SIZE]);
+void digestSha256(const void *data, size_t len, uint8_t out[SHA256_DIGEST_SIZE]);
+
+// Write `len` bytes as lowercase hex into `out`, which must hold
+// 2 * len + 1 characters.
+void digestToHex(const uint8_t *digest, size_t len, char *out);
+
+#endif /* FF_DIGEST_H_ */
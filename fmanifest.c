@@ -0,0 +1,258 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spi.h"
+#include "digest.h"
+#include "fmanifest.h"
+
+// Each manifest slot is one erase sector: an array of per-sector CRC32s
+// followed by a header in the last 32 bytes.  Pages are programmed in
+// ascending order, so the header is written last and a slot that was
+// interrupted mid-write fails its CRC and is ignored.
+//
+// An update goes through three steps, and at every point the valid
+// slot with the highest generation describes the flash conservatively:
+//  1. Write generation N+1 to the spare slot, with every sector that is
+//     about to change marked FMANIFEST_DIRTY.
+//  2. Erase and program the changed sectors.
+//  3. Write generation N+2, with the final hashes, to the other slot.
+
+#define FMANIFEST_HEADER_SIZE 32
+#define FMANIFEST_DIRTY 0x00000000
+
+struct fmanifest {
+    uint32_t generation;
+    uint32_t image_addr;
+    uint32_t image_length;
+    uint32_t sector_size;
+    uint32_t sectors;
+    uint32_t *hashes;
+};
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t fmanifest_capacity(uint32_t sector_size) {
+    return (sector_size - FMANIFEST_HEADER_SIZE) / 4;
+}
+
+// Parse one slot.  Returns 0 if it holds a valid manifest, 1 if it
+// doesn't, or -1 if there's no memory for the hashes.
+static int fmanifest_parse(struct fmanifest *m, const uint8_t *slot, uint32_t sector_size) {
+    const uint8_t *hdr = slot + sector_size - FMANIFEST_HEADER_SIZE;
+    uint32_t i;
+
+    if (get32(hdr + 0) != FMANIFEST_MAGIC)
+        return 1;
+    if (get32(hdr + 28) != digestCrc32(0, hdr, 28))
+        return 1;
+
+    m->generation = get32(hdr + 4);
+    m->image_addr = get32(hdr + 8);
+    m->image_length = get32(hdr + 12);
+    m->sector_size = get32(hdr + 16);
+    m->sectors = get32(hdr + 20);
+    if ((m->sector_size != sector_size) || (m->sectors > fmanifest_capacity(sector_size)))
+        return 1;
+    if (get32(hdr + 24) != digestCrc32(0, slot, m->sectors * 4))
+        return 1;
+
+    m->hashes = malloc(m->sectors * 4 + 1);
+    if (!m->hashes) {
+        perror("unable to allocate memory for manifest");
+        return -1;
+    }
+    for (i = 0; i < m->sectors; i++)
+        m->hashes[i] = get32(slot + i * 4);
+    return 0;
+}
+
+static int fmanifest_store(struct ff_spi *spi, uint32_t slot_addr, const struct fmanifest *m) {
+    uint8_t *slot = malloc(m->sector_size);
+    uint8_t *hdr;
+    uint32_t i;
+    int ret;
+
+    if (!slot) {
+        perror("unable to allocate memory for manifest");
+        return 1;
+    }
+    hdr = slot + m->sector_size - FMANIFEST_HEADER_SIZE;
+    memset(slot, 0xff, m->sector_size);
+    for (i = 0; i < m->sectors; i++)
+        put32(slot + i * 4, m->hashes[i]);
+    put32(hdr + 0, FMANIFEST_MAGIC);
+    put32(hdr + 4, m->generation);
+    put32(hdr + 8, m->image_addr);
+    put32(hdr + 12, m->image_length);
+    put32(hdr + 16, m->sector_size);
+    put32(hdr + 20, m->sectors);
+    put32(hdr + 24, digestCrc32(0, slot, m->sectors * 4));
+    put32(hdr + 28, digestCrc32(0, hdr, 28));
+
+    ret = spiWrite(spi, slot_addr, slot, m->sector_size, 1);
+    free(slot);
+    return ret;
+}
+
+// Hash a sector the way it will look in flash: padded with 0xff.
+static uint32_t fmanifest_hash(const uint8_t *data, uint32_t count,
+                               uint32_t offset, uint32_t sector_size) {
+    uint8_t erased[256];
+    uint32_t len = count - offset;
+    uint32_t crc;
+
+    memset(erased, 0xff, sizeof(erased));
+    if (len > sector_size)
+        len = sector_size;
+    crc = digestCrc32(0, data + offset, len);
+    for (; len < sector_size; len += sizeof(erased)) {
+        uint32_t pad = sector_size - len;
+        if (pad > sizeof(erased))
+            pad = sizeof(erased);
+        crc = digestCrc32(crc, erased, pad);
+    }
+    return crc;
+}
+
+int fmanifestWrite(struct ff_spi *spi, uint32_t manifest_addr, uint32_t addr,
+                   const uint8_t *data, uint32_t count, int quiet) {
+    uint32_t sector_size = spiEraseSize(spi);
+    uint32_t sectors = (count + sector_size - 1) / sector_size;
+    struct fmanifest slots[FMANIFEST_SLOTS];
+    struct fmanifest *cur = NULL;
+    struct fmanifest next;
+    uint8_t *dirty = NULL;
+    uint8_t *bfr;
+    int valid[FMANIFEST_SLOTS];
+    int cur_slot = 0;
+    uint32_t changed = 0;
+    uint32_t i;
+    int ret = 0;
+
+    if ((manifest_addr % sector_size) || (addr % sector_size)) {
+        fprintf(stderr, "manifest: image and manifest must be sector-aligned\n");
+        return 1;
+    }
+    if (sectors > fmanifest_capacity(sector_size)) {
+        fprintf(stderr, "manifest: image is too large (max %u sectors)\n",
+                fmanifest_capacity(sector_size));
+        return 1;
+    }
+    if ((addr < manifest_addr + FMANIFEST_SLOTS * sector_size)
+     && (manifest_addr < addr + count)) {
+        fprintf(stderr, "manifest: image overlaps the manifest at 0x%08x\n", manifest_addr);
+        return 1;
+    }
+
+    // Find the newest valid slot
+    memset(slots, 0, sizeof(slots));
+    memset(&next, 0, sizeof(next));
+    bfr = malloc(sector_size);
+    if (!bfr) {
+        perror("unable to allocate memory for manifest");
+        return 1;
+    }
+    for (i = 0; i < FMANIFEST_SLOTS; i++) {
+        spiRead(spi, manifest_addr + i * sector_size, bfr, sector_size);
+        ret = fmanifest_parse(&slots[i], bfr, sector_size);
+        if (ret < 0) {
+            free(bfr);
+            ret = 1;
+            goto out;
+        }
+        valid[i] = !ret;
+        if (valid[i] && (!cur || (slots[i].generation > cur->generation))) {
+            cur = &slots[i];
+            cur_slot = i;
+        }
+    }
+    ret = 0;
+    free(bfr);
+    if (cur && (cur->image_addr != addr))
+        cur = NULL;
+
+    next.generation = cur ? cur->generation + 1 : 1;
+    next.image_addr = addr;
+    next.image_length = count;
+    next.sector_size = sector_size;
+    next.sectors = sectors;
+    next.hashes = malloc(sectors * 4 + 1);
+    dirty = calloc(sectors + 1, 1);
+    if (!next.hashes || !dirty) {
+        perror("unable to allocate memory for manifest");
+        ret = 1;
+        goto out;
+    }
+
+    // Step 1: record which sectors are about to change
+    for (i = 0; i < sectors; i++) {
+        next.hashes[i] = fmanifest_hash(data, count, i * sector_size, sector_size);
+        if (!cur || (i >= cur->sectors) || (cur->hashes[i] != next.hashes[i])) {
+            dirty[i] = 1;
+            changed++;
+        }
+    }
+    if (!quiet)
+        printf("manifest: generation %u, %u of %u sector(s) changed\n",
+               cur ? cur->generation : 0, changed, sectors);
+
+    if (changed || !cur || (cur->image_length != count)) {
+        uint32_t *final_hashes = next.hashes;
+        int spare = cur ? !cur_slot : 0;
+
+        next.hashes = malloc(sectors * 4 + 1);
+        if (!next.hashes) {
+            perror("unable to allocate memory for manifest");
+            next.hashes = final_hashes;
+            ret = 1;
+            goto out;
+        }
+        for (i = 0; i < sectors; i++)
+            next.hashes[i] = dirty[i] ? FMANIFEST_DIRTY : final_hashes[i];
+        ret = fmanifest_store(spi, manifest_addr + spare * sector_size, &next);
+        free(next.hashes);
+        next.hashes = final_hashes;
+
+        // Step 2: write each contiguous run of changed sectors
+        i = 0;
+        while (!ret && (i < sectors)) {
+            uint32_t run_start, run_end;
+            if (!dirty[i]) {
+                i++;
+                continue;
+            }
+            run_start = i;
+            while ((i < sectors) && dirty[i])
+                i++;
+            run_end = i * sector_size;
+            if (run_end > count)
+                run_end = count;
+            ret = spiWrite(spi, addr + run_start * sector_size, data + run_start * sector_size,
+                           run_end - run_start * sector_size, quiet);
+        }
+
+        // Step 3: commit the final hashes to the other slot
+        if (!ret) {
+            next.generation++;
+            ret = fmanifest_store(spi, manifest_addr + !spare * sector_size, &next);
+        }
+    }
+
+out:
+    free(dirty);
+    free(next.hashes);
+    for (i = 0; i < FMANIFEST_SLOTS; i++)
+        free(slots[i].hashes);
+    return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef FF_FMANIFEST_H_
+#define FF_FMANIFEST_H_
+
+#include <stdint.h>
+
+struct ff_spi;
+
+#define FMANIFEST_MAGIC 0x4e4d4646 // "FFMN"
+
+// Two slots are used in turn, so the manifest occupies two sectors.
+#define FMANIFEST_SLOTS 2
+
+// Write `data` to `addr`, using the manifest kept in the two sectors at
+// `manifest_addr` to erase and program only the sectors whose hash
+// changed, then record the new hashes.  Returns 0 on success.
+int fmanifestWrite(struct ff_spi *spi, uint32_t manifest_addr, uint32_t addr,
+                   const uint8_t *data, uint32_t count, int quiet);
+
+#endif /* FF_FMANIFEST_H_ */
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -11,6 +12,22 @@
 #include "spi.h"
 #include "fpga.h"
 #include "ice40.h"
+#include "rt.h"
+#include "verify.h"
+#include "digest.h"
+#include "memscan.h"
+#include "shadow.h"
+#include "fmanifest.h"
+#include "journal.h"
+#include "segments.h"
+#include "image.h"
+#include "gang.h"
+#include "seq.h"
+#include "watch.h"
+#include "multiboot.h"
+#include "patchcache.h"
+#include "bitstream.h"
+#include "brammap.h"
 
 #define S_MOSI 10
 #define S_MISO 9
@@ -25,18 +42,9 @@
 static unsigned int F_RESET = 27;
 #define F_DONE 17
 
-// #define DEBUG_ICE40_PATCH
-
-#ifndef DEBUG_ICE40_PATCH
-static int spi_irw_readb(void *data) {
-    return spiRx(data);
-}
-
-static int spi_irw_writeb(void *data, uint8_t b) {
-    spiTx(data, b);
-    return b;
+static int spi_irw_write_block(void *data, const uint8_t *b, size_t count) {
+    return spiTxBuffer(data, b, count);
 }
-#endif
 
 static inline int isprint(int c)
 {
@@ -90,9 +98,116 @@ enum op {
     OP_FPGA_BOOT,
     OP_FPGA_RESET,
     OP_SET_QE,
+    OP_SPI_FINGERPRINT,
+    OP_SPI_BLANK_CHECK,
+    OP_SPI_SEGMENTS,
+    OP_FPGA_SEQUENCE,
+    OP_MULTIBOOT,
+    OP_ICE40_PATCH,
+    OP_BITSTREAM_INFO,
     OP_UNKNOWN,
 };
 
+// Options that only have a long form start after the last ASCII value
+enum long_opt {
+    LOPT_RT = 0x100,
+    LOPT_FAIL_FAST,
+    LOPT_PER_SECTOR,
+    LOPT_SPARSE,
+    LOPT_MAP,
+    LOPT_BLANK_CHECK,
+    LOPT_SHADOW,
+    LOPT_MANIFEST,
+    LOPT_JOURNAL,
+    LOPT_RESUME,
+    LOPT_GANG,
+    LOPT_RESET_LOW,
+    LOPT_RESET_WAIT,
+    LOPT_DONE_TIMEOUT,
+    LOPT_SEQUENCE,
+    LOPT_UART,
+    LOPT_WATCH,
+    LOPT_MULTIBOOT,
+    LOPT_SLOT,
+    LOPT_COLDBOOT,
+    LOPT_PATCH_CACHE,
+    LOPT_PATCH_CACHE_SIZE,
+    LOPT_BITSTREAM_INFO,
+    LOPT_BRAM_MAP,
+    LOPT_SAVE_BRAM_MAP,
+};
+
+// Output formats for the sector occupancy map
+enum map_format {
+    MAP_NONE,
+    MAP_TEXT,
+    MAP_JSON,
+};
+
+// Digests that can be computed by -c
+enum fingerprint_alg {
+    FA_CRC32 = (1 << 0),
+    FA_SHA256 = (1 << 1),
+};
+
+static const struct option long_options[] = {
+    {"rt", optional_argument, NULL, LOPT_RT},
+    {"fail-fast", no_argument, NULL, LOPT_FAIL_FAST},
+    {"per-sector", no_argument, NULL, LOPT_PER_SECTOR},
+    {"sparse", no_argument, NULL, LOPT_SPARSE},
+    {"map", optional_argument, NULL, LOPT_MAP},
+    {"blank-check", no_argument, NULL, LOPT_BLANK_CHECK},
+    {"shadow", optional_argument, NULL, LOPT_SHADOW},
+    {"manifest", optional_argument, NULL, LOPT_MANIFEST},
+    {"journal", optional_argument, NULL, LOPT_JOURNAL},
+    {"resume", no_argument, NULL, LOPT_RESUME},
+    {"gang", required_argument, NULL, LOPT_GANG},
+    {"reset-low", required_argument, NULL, LOPT_RESET_LOW},
+    {"reset-wait", required_argument, NULL, LOPT_RESET_WAIT},
+    {"done-timeout", required_argument, NULL, LOPT_DONE_TIMEOUT},
+    {"sequence", required_argument, NULL, LOPT_SEQUENCE},
+    {"uart", required_argument, NULL, LOPT_UART},
+    {"watch", optional_argument, NULL, LOPT_WATCH},
+    {"multiboot", optional_argument, NULL, LOPT_MULTIBOOT},
+    {"slot", required_argument, NULL, LOPT_SLOT},
+    {"coldboot", no_argument, NULL, LOPT_COLDBOOT},
+    {"patch-cache", optional_argument, NULL, LOPT_PATCH_CACHE},
+    {"patch-cache-size", required_argument, NULL, LOPT_PATCH_CACHE_SIZE},
+    {"bitstream-info", required_argument, NULL, LOPT_BITSTREAM_INFO},
+    {"bram-map", required_argument, NULL, LOPT_BRAM_MAP},
+    {"save-bram-map", required_argument, NULL, LOPT_SAVE_BRAM_MAP},
+    {NULL, 0, NULL, 0},
+};
+
+// Print which sectors hold data, either as a text grid (one character
+// per sector) or as JSON with an LSB-first hex bitmap.
+static void print_occupancy(FILE *stream, const uint8_t *occupancy, uint32_t sectors,
+                            uint32_t base, uint32_t sector_size, int json)
+{
+    uint32_t i;
+    uint32_t used = 0;
+
+    for (i = 0; i < sectors; i++)
+        if (occupancy[i / 8] & (1 << (i & 7)))
+            used++;
+
+    if (json) {
+        fprintf(stream, "{\"base\": %u, \"sector_size\": %u, \"sectors\": %u, \"used\": %u, \"bitmap\": \"",
+                base, sector_size, sectors, used);
+        for (i = 0; i < (sectors + 7) / 8; i++)
+            fprintf(stream, "%02x", occupancy[i]);
+        fprintf(stream, "\"}\n");
+        return;
+    }
+
+    for (i = 0; i < sectors; i++) {
+        if ((i & 63) == 0)
+            fprintf(stream, "%s%08x ", i ? "\n" : "", base + i * sector_size);
+        fputc((occupancy[i / 8] & (1 << (i & 7))) ? '#' : '.', stream);
+    }
+    fprintf(stream, "\n%u of %u sectors in use\n", used, sectors);
+}
+
 static int pinspec_to_pinname(char code) {
     switch (code) {
         case '0': return SP_D0;
@@ -137,13 +252,20 @@ static int print_program_modes(FILE *stream) {
     fprintf(stream, "    -q        Quiet operation\n");
     fprintf(stream, "    -p offset Peek at 256 bytes of SPI flash at the specified offset\n");
     fprintf(stream, "    -f bin    Load this bitstream directly into the FPGA\n");
-    fprintf(stream, "    -l rom    Replace the ROM in the bitstream with this file\n");
-    fprintf(stream, "    -w bin    Write this binary into the SPI flash chip\n");
+    fprintf(stream, "    -l rom[:size|auto[:seed]] Replace a ROM in the -f or -w bitstream with this file (may be repeated)\n");
+    fprintf(stream, "    -w bin    Write this binary (optionally lz4 or zstd compressed) into the SPI flash chip\n");
     fprintf(stream, "    -a addr   Change the address to write/read from\n");
+    fprintf(stream, "    -m file   Write and verify every segment in a manifest, Intel HEX or UF2 file\n");
     fprintf(stream, "    -v bin    Verify the SPI flash contains this data\n");
     fprintf(stream, "    -s out    Save the SPI flash contents to this file\n");
     fprintf(stream, "    -k n[:f]  Read security register [n], or update it with the contents of file [f]\n");
     fprintf(stream, "    -4        Sets the QE enable bit\n");
+    fprintf(stream, "    --blank-check Check that the range from -a (and -n) is erased\n");
+    fprintf(stream, "    --map[=json] Print which sectors hold data (also with -s)\n");
+    fprintf(stream, "    -c algs   Print the crc32 and/or sha256 (comma separated) of SPI flash\n");
+    fprintf(stream, "    --sequence=file Boot each bitstream in a test sequence, checking for pass signals\n");
+    fprintf(stream, "    --bitstream-info=bin List the commands in a bitstream and check its CRCs\n");
+    fprintf(stream, "    --multiboot[=a0,a1,a2,a3] Print the multiboot header, or write one with these slot addresses\n");
     return 0;
 }
 
@@ -151,7 +273,7 @@ static int print_help(FILE *stream, const char *progname) {
     fprintf(stream, "Fomu Raspberry Pi Flash Utilities\n");
     fprintf(stream, "Usage:\n");
     fprintf(stream, "%15s  (-[hri] | [-p offset] | [-f bitstream] | \n", progname);
-    fprintf(stream, "%15s            [-w bin] | [-v bin] | [-s out] | [-k n[:f]])\n", "");
+    fprintf(stream, "%15s            [-w bin] | [-v bin] | [-s out] | [-k n[:f]] | [-c algs] | [-m file])\n", "");
     fprintf(stream, "                [-g pinspec] [-t spitype] [-b bytes] [-a addr] [-u]\n");
     fprintf(stream, "\n");
     fprintf(stream, "Program mode (pick one):\n");
@@ -159,11 +281,32 @@ static int print_help(FILE *stream, const char *progname) {
     fprintf(stream, "\n");
     fprintf(stream, "Configuration options:\n");
     fprintf(stream, "    -g ps     Set the pin assignment with the given pinspec\n");
-#ifndef DEBUG_ICE40_PATCH
     fprintf(stream, "    -t type   Set the number of bits to use for SPI (1, 2, 4, or Q)\n");
     fprintf(stream, "    -u        Unlock the SPI Global Block Protect with a 0x98 command\n");
     fprintf(stream, "    -b bytes  Override the size of the SPI flash, in bytes\n");
-#endif
+    fprintf(stream, "    -n bytes  Number of bytes to fingerprint with -c (default: to end of flash)\n");
+    fprintf(stream, "    --gang=mosi:miso[:cs],... With -w, -v or -i, use several chips sharing CLK and CS\n");
+    fprintf(stream, "    --journal[=file] With -w, record progress in file (default: bin.journal)\n");
+    fprintf(stream, "    --resume  With -w, continue an interrupted write from its journal\n");
+    fprintf(stream, "    --manifest[=addr] With -w, keep sector hashes in flash and only program changes\n");
+    fprintf(stream, "    --shadow[=dir] With -w, only program sectors that changed since the last write\n");
+    fprintf(stream, "    --sparse  Leave erased sectors as holes in the -s output file\n");
+    fprintf(stream, "    --per-sector Also print a digest for every erase sector with -c (the\n");
+    fprintf(stream, "                 first line starts at -a, the rest on sector boundaries)\n");
+    fprintf(stream, "    --fail-fast Stop verifying at the first mismatch\n");
+    fprintf(stream, "    --slot=n  With -w or -v, use multiboot slot n (0-3), leaving the other slots alone\n");
+    fprintf(stream, "    --coldboot With --multiboot=, let the CBSEL pins pick the power-on image\n");
+    fprintf(stream, "    -o file   With -f and -l, write the patched bitstream to file without booting it\n");
+    fprintf(stream, "    --save-bram-map=file With -l, record where each ROM was found in the bitstream\n");
+    fprintf(stream, "    --bram-map=file With -l, patch the blocks listed in file without looking for ROMs\n");
+    fprintf(stream, "    --patch-cache[=dir] With -l, keep patched bitstreams for next time\n");
+    fprintf(stream, "    --patch-cache-size=MiB Limit the patch cache to this size (default 64)\n");
+    fprintf(stream, "    --watch[=ms] With -f, reload the FPGA whenever the bitstream (or -l rom) changes\n");
+    fprintf(stream, "    --uart=dev Read --sequence pass messages from this UART (default /dev/serial0)\n");
+    fprintf(stream, "    --reset-low=us   Hold CRESET low for this long (default 1)\n");
+    fprintf(stream, "    --reset-wait=us  Wait this long after reset before configuring over SPI (default 1200)\n");
+    fprintf(stream, "    --done-timeout=ms Fail -r if CDONE doesn't rise in this long (default 1000)\n");
+    fprintf(stream, "    --rt[=cpu] Pin to an isolated core with SCHED_FIFO and locked memory\n");
     fprintf(stream, "You can remap various pins with -g.  The format is [name]:[number].\n");
     fprintf(stream, "\n");
     fprintf(stream, "The width of SPI can be set with 't [width]'.  Valid widths are:\n");
@@ -176,6 +319,298 @@ static int print_help(FILE *stream, const char *progname) {
     return 0;
 }
 
+// Open every ROM given with -l.  Returns 0 on success, or -1 with none
+// of them left open.
+static int roms_open(struct ice40_rom *roms, const char *const *filenames, int count)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        roms[i].file = irw_open(filenames[i], "r");
+        if (!roms[i].file) {
+            perror(filenames[i]);
+            while (i--)
+                irw_close(&roms[i].file);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void roms_close(struct ice40_rom *roms, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        irw_close(&roms[i].file);
+}
+
+// Run `op` on every flash chip in the gang.  Only the operations that
+// make sense for several chips at once are supported.
+static int gang_run(struct ff_spi *spi, const char *spec, enum op op,
+                    const char *filename, uint32_t addr, int quiet, int fail_fast)
+{
+    const uint8_t *images[GANG_MAX_DEVICES];
+    struct ff_gang *gang;
+    struct image *img;
+    uint8_t *bfr;
+    uint32_t length;
+    int i;
+
+    if ((op != OP_SPI_WRITE) && (op != OP_SPI_VERIFY) && (op != OP_SPI_ID)) {
+        fprintf(stderr, "--gang only supports -w, -v and -i\n");
+        return 1;
+    }
+
+    gang = gangAlloc(spi);
+    if (!gang || gangParse(gang, spec) || !gangCount(gang)) {
+        gangFree(&gang);
+        return 1;
+    }
+    gangInit(gang);
+
+    if ((op == OP_SPI_WRITE) || (op == OP_SPI_VERIFY)) {
+        img = imageOpen(filename);
+        if (!img) {
+            perror("unable to open input file");
+            gangFree(&gang);
+            return 1;
+        }
+        bfr = imageReadAll(img, &length);
+        imageClose(&img);
+        if (!bfr) {
+            fprintf(stderr, "unable to read from file\n");
+            gangFree(&gang);
+            return 1;
+        }
+
+        // Every chip gets the same image
+        for (i = 0; i < gangCount(gang); i++)
+            images[i] = bfr;
+        // A gang write only passes once every chip has been read back
+        if (op == OP_SPI_WRITE)
+            gangWrite(gang, addr, images, length, quiet);
+        gangVerify(gang, addr, images, length, fail_fast);
+        free(bfr);
+    }
+
+    i = gangReport(gang, stdout);
+    gangFree(&gang);
+    return i ? 1 : 0;
+}
+
+// Patched bitstreams go to the FPGA and into memory at the same time,
+// so they can be cached once the FPGA has booted.
+struct patch_capture {
+    struct ff_spi *spi;
+    uint8_t *data;
+    size_t length;
+    size_t size;
+    int failed;
+};
+
+static int capture_irw_write_block(void *data, const uint8_t *b, size_t count) {
+    struct patch_capture *capture = data;
+
+    if (!capture->failed && (capture->length + count > capture->size)) {
+        size_t size = capture->size ? capture->size * 2 : 262144;
+        uint8_t *grown;
+        while (size < capture->length + count)
+            size *= 2;
+        grown = realloc(capture->data, size);
+        if (grown) {
+            capture->data = grown;
+            capture->size = size;
+        }
+        else
+            capture->failed = 1;
+    }
+    if (!capture->failed) {
+        memcpy(capture->data + capture->length, b, count);
+        capture->length += count;
+    }
+    return capture->spi ? spiTxBuffer(capture->spi, b, count) : 0;
+}
+
+// The ROMs given with -l, and how to patch them into a bitstream
+struct patch_job {
+    struct ice40_rom roms[ICE40_MAX_ROMS];
+    const char *filenames[ICE40_MAX_ROMS];
+    int count;
+    const struct patch_cache *cache;    // NULL to patch every time
+    struct ice40_bram_map *maps;        // Patch these blocks without a scan
+    int map_count;
+    const char *save_map;               // Record where the scan finds the ROMs
+};
+
+// Patch the ROMs into a bitstream in memory, without sending it
+// anywhere.  Returns the patched bitstream, to be freed by the caller,
+// or NULL on error.
+static uint8_t *patch_bitstream(const char *filename, struct patch_job *job, uint32_t *length)
+{
+    struct patch_capture capture = { NULL, NULL, 0, 0, 0 };
+    char key[PATCHCACHE_KEY_LEN];
+    IRW_FILE *out;
+    int ret;
+
+    // A scan that records a map has to run, and a map is quick enough
+    // that its results aren't worth caching.
+    int use_cache = job->cache && !job->maps && !job->save_map;
+
+    if (use_cache) {
+        uint8_t *cached;
+        if (patchCacheKey(filename, job->filenames, job->roms, job->count, key))
+            return NULL;
+        cached = patchCacheGet(job->cache, key, length);
+        if (cached)
+            return cached;
+    }
+
+    if (roms_open(job->roms, job->filenames, job->count))
+        return NULL;
+    out = irw_open_block(&capture, capture_irw_write_block);
+    if (job->maps) {
+        struct bitstream *bs = bitstreamOpen(filename);
+        ret = bs ? ice40_patch_direct(bs, job->roms, job->count, job->maps, job->map_count, out) : -1;
+        bitstreamClose(&bs);
+    }
+    else {
+        IRW_FILE *bitstream = irw_open(filename, "r");
+        if (!bitstream) {
+            perror("unable to open fpga bitstream");
+            ret = -1;
+        }
+        else if (job->save_map) {
+            struct ice40_bram_map *maps = NULL;
+            int map_count = 0;
+            ret = ice40_patch_record(bitstream, job->roms, job->count, out, &maps, &map_count);
+            if ((ret >= 0) && bramMapSave(job->save_map, maps, map_count))
+                ret = -1;
+            free(maps);
+        }
+        else
+            ret = ice40_patch(bitstream, job->roms, job->count, out);
+        irw_close(&bitstream);
+    }
+    irw_close(&out);
+    roms_close(job->roms, job->count);
+
+    if ((ret < 0) || capture.failed) {
+        if (capture.failed)
+            fprintf(stderr, "unable to allocate memory for patched bitstream\n");
+        free(capture.data);
+        return NULL;
+    }
+    if (use_cache)
+        patchCachePut(job->cache, key, capture.data, capture.length);
+    *length = capture.length;
+    return capture.data;
+}
+
+// Load a bitstream into the FPGA over slave SPI, patching in new ROMs
+// on the way if any are given.  With a patch cache, a bitstream that
+// has been patched with the same ROMs before is sent as it was then.
+// Returns 0 once CDONE has risen.
+static int fpga_boot(struct ff_spi *spi, struct ff_fpga *fpga, const char *filename,
+                     struct patch_job *job)
+{
+    IRW_FILE *bitstream = NULL;
+    struct image *img = NULL;
+    struct patch_capture capture = { spi, NULL, 0, 0, 0 };
+    const struct patch_cache *cache = job->cache;
+    char key[PATCHCACHE_KEY_LEN];
+    uint8_t *patched = NULL;
+    uint32_t patched_length = 0;
+    int count = 0;
+    int ret = 0;
+
+    // Patching from a map (or recording one) is done up front, and so
+    // is looking in the cache.  Otherwise the patch overlaps the load.
+    if (job->count && (job->maps || job->save_map)) {
+        patched = patch_bitstream(filename, job, &patched_length);
+        if (!patched)
+            return 1;
+    }
+    else if (job->count && cache) {
+        if (patchCacheKey(filename, job->filenames, job->roms, job->count, key))
+            cache = NULL;
+        else if ((patched = patchCacheGet(cache, key, &patched_length)) != NULL)
+            fprintf(stderr, "using cached patched bitstream %.16s\n", key);
+    }
+
+    if (!patched && job->count)
+        bitstream = irw_open(filename, "r");
+    else if (!patched)
+        img = imageOpen(filename);
+    if (!patched && !bitstream && !img) {
+        perror("unable to open fpga bitstream");
+        return 1;
+    }
+    if (bitstream && roms_open(job->roms, job->filenames, job->count)) {
+        irw_close(&bitstream);
+        return 1;
+    }
+
+    fpgaSlaveBegin(fpga, spi);
+    fprintf(stderr, "FPGA Done? %d\n", fpgaDone(fpga));
+    if (patched) {
+        spiTxBuffer(spi, patched, patched_length);
+        free(patched);
+    }
+    else if (job->count) {
+        IRW_FILE *spidev = cache ? irw_open_block(&capture, capture_irw_write_block)
+                                 : irw_open_block(spi, spi_irw_write_block);
+        if (ice40_patch(bitstream, job->roms, job->count, spidev) < 0)
+            ret = 1;
+        irw_close(&spidev);
+        irw_close(&bitstream);
+        roms_close(job->roms, job->count);
+    }
+    else {
+        uint8_t bfr[32768];
+        while ((count = imageRead(img, bfr, sizeof(bfr))) > 0)
+            spiTxBuffer(spi, bfr, count);
+        imageClose(&img);
+        if (count < 0) {
+            fprintf(stderr, "unable to read from fpga bitstream file\n");
+            ret = 1;
+        }
+    }
+
+    int boot_us = fpgaSlaveFinish(fpga, spi, &count);
+    if (boot_us >= 0)
+        fprintf(stderr, "FPGA Done? 1 (%d us after reset, %d trailing clocks)\n", boot_us, count);
+    else {
+        fprintf(stderr, "FPGA Done? 0 (gave up after %d trailing clocks)\n", count);
+        ret = 1;
+    }
+
+    // Only keep patched bitstreams that the FPGA accepted
+    if (capture.data && !ret && !capture.failed)
+        patchCachePut(cache, key, capture.data, capture.length);
+    free(capture.data);
+    return ret;
+}
+
+// Write the whole of `data` to the file the user asked for with -o
+static int write_output_file(const char *path, const uint8_t *data, uint32_t length)
+{
+    FILE *f = fopen(path, "w");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (fwrite(data, 1, length, f) != length) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    if (fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
 static int print_usage_error(FILE *stream) {
     fprintf(stream, "Error: You must only specify one program mode:\n");
     print_program_modes(stream);
@@ -191,29 +626,41 @@ int main(int argc, char **argv) {
     struct ff_fpga *fpga;
     int peek_offset = 0;
     uint32_t addr = 0;
-#ifndef DEBUG_ICE40_PATCH
     int spi_flash_bytes = -1;
     enum spi_type spi_type = ST_SINGLE;
-#endif
-    uint8_t security_reg;
+    uint8_t security_reg = 0;
     uint8_t security_val[256];
     enum op op = OP_UNKNOWN;
-    struct irw_file *replacement_rom = NULL;
+    struct patch_job job;
+    const char *bram_map = NULL;
     int quiet = 0;
-
-#ifndef DEBUG_ICE40_PATCH
-    if (gpioInitialise() < 0) {
-        fprintf(stderr, "Unable to initialize GPIO\n");
-        return 1;
-    }
-
-    // The original Raspberry Pi boards had a different assignment
-    // of pin 13.  All other boards assign it to BCM 27, but the
-    // original had it as BCM 21.
-    if ((gpioHardwareRevision() == 2) || (gpioHardwareRevision() == 3))
-        F_RESET = 21;
-#endif
-
+    int rt = 0;
+    int rt_cpu = -1;
+    int fail_fast = 0;
+    int fingerprint_algs = 0;
+    int fingerprint_per_sector = 0;
+    int64_t length = -1;
+    int sparse = 0;
+    enum map_format map = MAP_NONE;
+    int shadow = 0;
+    const char *shadow_dir = NULL;
+    int manifest = 0;
+    int64_t manifest_addr = -1;
+    int journal = 0;
+    int resume = 0;
+    const char *journal_path = NULL;
+    const char *gang_spec = NULL;
+    const char *uart_dev = "/dev/serial0";
+    int watch = 0;
+    uint32_t watch_ms = WATCH_DEBOUNCE_MS;
+    const char *multiboot_spec = NULL;
+    int coldboot = 0;
+    int slot = -1;
+    int patch_cache = 0;
+    struct patch_cache cache = { NULL, PATCHCACHE_DEFAULT_MAX_BYTES };
+    const char *patch_output = NULL;
+
+    memset(&job, 0, sizeof(job));
     spi = spiAlloc();
     fpga = fpgaAlloc();
 
@@ -231,13 +678,167 @@ int main(int argc, char **argv) {
     // by default do not unlock the chip
     spiSetUnlockCmd(spi, NO_UNLOCK_CMD);
 
-    fpgaSetPin(fpga, FP_RESET, F_RESET);
     fpgaSetPin(fpga, FP_DONE, F_DONE);
     fpgaSetPin(fpga, FP_CS, S_CE0);
 
-    while ((opt = getopt(argc, argv, "hiqp:rf:a:b:w:s:2:3:v:g:t:k:l:4:u")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hiqp:rf:a:b:w:s:2:3:v:g:t:k:l:4:uc:n:m:o:",
+                              long_options, NULL)) != -1) {
         switch (opt) {
 
+        case LOPT_RT:
+            rt = 1;
+            if (optarg)
+                rt_cpu = strtoul(optarg, NULL, 0);
+            break;
+
+        case LOPT_FAIL_FAST:
+            fail_fast = 1;
+            break;
+
+        case LOPT_PER_SECTOR:
+            fingerprint_per_sector = 1;
+            break;
+
+        case LOPT_SPARSE:
+            sparse = 1;
+            break;
+
+        case LOPT_MAP:
+            map = (optarg && !strcmp(optarg, "json")) ? MAP_JSON : MAP_TEXT;
+            break;
+
+        case LOPT_SHADOW:
+            shadow = 1;
+            shadow_dir = optarg;
+            break;
+
+        case LOPT_MANIFEST:
+            manifest = 1;
+            if (optarg)
+                manifest_addr = strtoul(optarg, NULL, 0);
+            break;
+
+        case LOPT_JOURNAL:
+            journal = 1;
+            if (optarg)
+                journal_path = optarg;
+            break;
+
+        case LOPT_RESUME:
+            journal = 1;
+            resume = 1;
+            break;
+
+        case LOPT_RESET_LOW:
+            fpgaSetTiming(fpga, FT_RESET_LOW, strtoul(optarg, NULL, 0));
+            break;
+
+        case LOPT_RESET_WAIT:
+            fpgaSetTiming(fpga, FT_CONFIG_WAIT, strtoul(optarg, NULL, 0));
+            break;
+
+        case LOPT_DONE_TIMEOUT:
+            fpgaSetTiming(fpga, FT_DONE_TIMEOUT, strtoul(optarg, NULL, 0) * 1000);
+            break;
+
+        case LOPT_SEQUENCE:
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_FPGA_SEQUENCE;
+            if (op_filename)
+                free(op_filename);
+            op_filename = strdup(optarg);
+            break;
+
+        case LOPT_WATCH:
+            watch = 1;
+            if (optarg)
+                watch_ms = strtoul(optarg, NULL, 0);
+            break;
+
+        case LOPT_MULTIBOOT:
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_MULTIBOOT;
+            multiboot_spec = optarg;
+            break;
+
+        case LOPT_SLOT:
+            slot = strtol(optarg, NULL, 0);
+            if ((slot < 0) || (slot >= MULTIBOOT_SLOTS)) {
+                fprintf(stderr, "--slot must be between 0 and %d\n", MULTIBOOT_SLOTS - 1);
+                return 1;
+            }
+            break;
+
+        case LOPT_COLDBOOT:
+            coldboot = 1;
+            break;
+
+        case LOPT_BITSTREAM_INFO:
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_BITSTREAM_INFO;
+            if (op_filename)
+                free(op_filename);
+            op_filename = strdup(optarg);
+            break;
+
+        case LOPT_BRAM_MAP:
+            bram_map = optarg;
+            break;
+
+        case LOPT_SAVE_BRAM_MAP:
+            job.save_map = optarg;
+            break;
+
+        case LOPT_PATCH_CACHE:
+            patch_cache = 1;
+            cache.dir = optarg;
+            break;
+
+        case LOPT_PATCH_CACHE_SIZE:
+            patch_cache = 1;
+            cache.max_bytes = strtoull(optarg, NULL, 0) * 1024 * 1024;
+            break;
+
+        case LOPT_UART:
+            uart_dev = optarg;
+            break;
+
+        case LOPT_GANG:
+            gang_spec = optarg;
+            break;
+
+        case LOPT_BLANK_CHECK:
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_SPI_BLANK_CHECK;
+            break;
+
+        case 'n':
+            length = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'c': {
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_SPI_FINGERPRINT;
+            char *alg = strtok(optarg, ",");
+            while (alg) {
+                if (!strcmp(alg, "crc32"))
+                    fingerprint_algs |= FA_CRC32;
+                else if (!strcmp(alg, "sha256"))
+                    fingerprint_algs |= FA_SHA256;
+                else {
+                    fprintf(stderr, "Unrecognized digest '%s'.  Valid digests are: crc32, sha256\n", alg);
+                    return 1;
+                }
+                alg = strtok(NULL, ",");
+            }
+            break;
+        }
+
         case 'a':
             addr = strtoul(optarg, NULL, 0);
             break;
@@ -252,7 +853,6 @@ int main(int argc, char **argv) {
             op = OP_FPGA_RESET;
             break;
 
-#ifndef DEBUG_ICE40_PATCH
         case 'b':
             spi_flash_bytes = strtoul(optarg, NULL, 0);
             break;
@@ -279,14 +879,37 @@ int main(int argc, char **argv) {
                 return 1;
             }
             break;
-#endif
 
-        case 'l':
-            replacement_rom = irw_open(optarg, "r");
-            if (!replacement_rom) {
+        case 'l': {
+            if (job.count >= ICE40_MAX_ROMS) {
+                fprintf(stderr, "at most %d roms may be given with -l\n", ICE40_MAX_ROMS);
+                return 10;
+            }
+
+            // ":size" and ":seed" describe the ROM in the bitstream
+            char *opt = strchr(optarg, ':');
+            memset(&job.roms[job.count], 0, sizeof(job.roms[job.count]));
+            if (opt) {
+                *opt++ = '\0';
+                if (!strncmp(opt, "auto", 4)) {
+                    job.roms[job.count].size = ICE40_ROM_SIZE_AUTO;
+                    opt += 4;
+                }
+                else
+                    job.roms[job.count].size = strtoul(opt, &opt, 0);
+                if (*opt == ':')
+                    job.roms[job.count].seed = strtoul(opt + 1, NULL, 0);
+            }
+            if (access(optarg, R_OK) == -1) {
                 perror("couldn't open replacement rom file");
                 return 10;
             }
+            job.filenames[job.count++] = optarg;
+            break;
+        }
+
+        case 'o':
+            patch_output = optarg;
             break;
 
         case 'k': {
@@ -366,6 +989,15 @@ int main(int argc, char **argv) {
             op_filename = strdup(optarg);
             break;
 
+        case 'm':
+            if (op != OP_UNKNOWN)
+                return print_usage_error(stdout);
+            op = OP_SPI_SEGMENTS;
+            if (op_filename)
+                free(op_filename);
+            op_filename = strdup(optarg);
+            break;
+
         case 'v':
             if (op != OP_UNKNOWN)
                 return print_usage_error(stdout);
@@ -396,30 +1028,117 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (patch_output) {
+        if ((op != OP_FPGA_BOOT) || !job.count) {
+            fprintf(stderr, "-o needs a bitstream to patch with -f and roms with -l\n");
+            return 1;
+        }
+        op = OP_ICE40_PATCH;
+    }
+
+    if ((bram_map || job.save_map) && !job.count) {
+        fprintf(stderr, "--bram-map and --save-bram-map need roms with -l\n");
+        return 1;
+    }
+    if (bram_map && job.save_map) {
+        fprintf(stderr, "only one of --bram-map or --save-bram-map may be used\n");
+        return 1;
+    }
+    if (bram_map && bramMapLoad(bram_map, &job.maps, &job.map_count))
+        return 1;
+    if (patch_cache)
+        job.cache = &cache;
+
+    if (job.count && gang_spec) {
+        fprintf(stderr, "--gang can't be used with -l\n");
+        return 1;
+    }
+
+    if (job.count && (op != OP_FPGA_BOOT) && (op != OP_ICE40_PATCH) && (op != OP_SPI_WRITE)) {
+        fprintf(stderr, "-l only works with -f or -w\n");
+        return 1;
+    }
+
+    if (watch && (op != OP_FPGA_BOOT)) {
+        fprintf(stderr, "--watch only works with -f\n");
+        return 1;
+    }
+
+    if ((slot != -1) && (((op != OP_SPI_WRITE) && (op != OP_SPI_VERIFY)) || gang_spec
+                         || shadow || manifest || journal)) {
+        fprintf(stderr, "--slot only works with a plain -w or -v\n");
+        return 1;
+    }
+
+    if (shadow + manifest + journal > 1) {
+        fprintf(stderr, "only one of --shadow, --manifest or --journal may be used\n");
+        return 1;
+    }
+
+    // A map on its own is a read that doesn't save anything
+    if ((op == OP_UNKNOWN) && (map != MAP_NONE))
+        op = OP_SPI_READ;
+
     if (op == OP_UNKNOWN) {
         print_help(stdout, argv[0]);
         return 1;
     }
 
-#ifndef DEBUG_ICE40_PATCH
+    if (rt) {
+        struct rt_jitter before, after;
+        before = rtMeasureJitter(200);
+        rtEnable(rt_cpu);
+        after = rtMeasureJitter(200);
+        if (!quiet) {
+            rtPrintJitter(stderr, "before:", &before);
+            rtPrintJitter(stderr, "after:", &after);
+        }
+    }
+
+    // Patching into a file, or looking at one, doesn't need any hardware
+    if (op == OP_ICE40_PATCH) {
+        uint32_t patched_length;
+        uint8_t *patched = patch_bitstream(op_filename, &job, &patched_length);
+        if (!patched)
+            return 1;
+        ret = write_output_file(patch_output, patched, patched_length) ? 1 : 0;
+        free(patched);
+        return ret;
+    }
+
+    if (op == OP_BITSTREAM_INFO) {
+        struct bitstream *bs = bitstreamOpen(op_filename);
+        if (!bs)
+            return 1;
+        if (!quiet)
+            bitstreamPrint(stdout, bs);
+        ret = bitstreamCheckCrc(bs, stdout) ? 1 : 0;
+        bitstreamClose(&bs);
+        return ret;
+    }
+
+    if (gpioInitialise() < 0) {
+        fprintf(stderr, "Unable to initialize GPIO\n");
+        return 1;
+    }
+
+    // The original Raspberry Pi boards had a different assignment
+    // of pin 13.  All other boards assign it to BCM 27, but the
+    // original had it as BCM 21.
+    if ((gpioHardwareRevision() == 2) || (gpioHardwareRevision() == 3))
+        F_RESET = 21;
+
+    fpgaSetPin(fpga, FP_RESET, F_RESET);
     fpgaInit(fpga);
     fpgaReset(fpga);
+    if (gang_spec)
+        return gang_run(spi, gang_spec, op, op_filename, addr, quiet, fail_fast);
     spiInit(spi);
 
     spiSetType(spi, spi_type);
 
     if (spi_flash_bytes != -1)
         spiOverrideSize(spi, spi_flash_bytes);
-#else
-    if (op != OP_FPGA_BOOT) {
-        printf("DEBUG_ICE40_PATCH requires you load a bitstream with '-f'\n");
-        return 9;
-    }
-    if (!replacement_rom) {
-        printf("DEBUG_ICE40_PATCH requires you load a replacement rom with '-l'\n");
-        return 10;
-    }
-#endif
 
     switch (op) {
     case OP_SPI_ID: {
@@ -456,93 +1175,342 @@ int main(int argc, char **argv) {
 
     case OP_SPI_READ: {
         struct spi_id id = spiId(spi);
-        if (id.bytes == -1) {
-            fprintf(stderr, "unknown spi flash size -- specify with -b\n");
+        uint32_t sector_size = spiEraseSize(spi);
+        if (length == -1) {
+            if (id.bytes == -1) {
+                fprintf(stderr, "unknown spi flash size -- specify with -b\n");
+                return 1;
+            }
+            length = id.bytes;
+        }
+
+        fd = -1;
+        if (op_filename) {
+            fd = open(op_filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+            if (fd == -1) {
+                perror("unable to open output file");
+                break;
+            }
+        }
+        uint32_t sectors = (length + sector_size - 1) / sector_size;
+        uint8_t *bfr = malloc(sector_size);
+        uint8_t *occupancy = calloc((sectors + 7) / 8, 1);
+        if (!bfr || !occupancy) {
+            perror("unable to allocate memory for spi");
             return 1;
         }
+        if (rt)
+            rtPrefault(bfr, sector_size);
+
+        uint32_t offset;
+        for (offset = 0; offset < length; offset += sector_size) {
+            uint32_t len = length - offset;
+            if (len > sector_size)
+                len = sector_size;
+            spiRead(spi, addr + offset, bfr, len);
+
+            int erased = memscanErased(bfr, len) == len;
+            if (!erased)
+                occupancy[(offset / sector_size) / 8] |= 1 << ((offset / sector_size) & 7);
+            if (fd == -1)
+                continue;
+
+            // Leave a hole rather than writing out erased sectors
+            if (sparse && erased) {
+                if (lseek(fd, len, SEEK_CUR) == -1) {
+                    perror("unable to seek in output file");
+                    break;
+                }
+            }
+            else if (write(fd, bfr, len) != len) {
+                perror("unable to write SPI flash image to disk");
+                break;
+            }
+        }
+        // A trailing hole only exists once the file size covers it
+        if ((fd != -1) && sparse && (ftruncate(fd, length) == -1))
+            perror("unable to set SPI flash image size");
 
-        fd = open(op_filename, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-        if (fd == -1) {
-            perror("unable to open output file");
-            break;
+        if (map != MAP_NONE)
+            print_occupancy(stdout, occupancy, sectors, addr, sector_size, map == MAP_JSON);
+        if (fd != -1)
+            close(fd);
+        free(occupancy);
+        free(bfr);
+        break;
+    }
+
+    case OP_SPI_BLANK_CHECK: {
+        struct spi_id id = spiId(spi);
+        uint32_t sector_size = spiEraseSize(spi);
+        if (length == -1) {
+            if (id.bytes == -1) {
+                fprintf(stderr, "unknown spi flash size -- specify with -b or -n\n");
+                return 1;
+            }
+            length = id.bytes - addr;
         }
-        uint8_t *bfr = malloc(id.bytes);
+
+        uint8_t *bfr = malloc(sector_size);
         if (!bfr) {
             perror("unable to allocate memory for spi");
             return 1;
         }
-        spiRead(spi, addr, bfr, id.bytes);
-        if (write(fd, bfr, id.bytes) != id.bytes) {
-            perror("unable to write SPI flash image to disk");
-            break;
+
+        uint32_t offset;
+        for (offset = 0; offset < length; offset += sector_size) {
+            uint32_t len = length - offset;
+            if (len > sector_size)
+                len = sector_size;
+            spiRead(spi, addr + offset, bfr, len);
+            uint32_t first = memscanErased(bfr, len);
+            if (first < len) {
+                printf("not blank @ 0x%08x: %02x\n", addr + offset + first, bfr[first]);
+                ret = 1;
+                break;
+            }
         }
-        close(fd);
+        if (!ret)
+            printf("blank 0x%08x-0x%08x\n", addr, (uint32_t)(addr + length));
         free(bfr);
         break;
     }
 
     case OP_SPI_WRITE: {
-        fd = open(op_filename, O_RDONLY);
-        if (fd == -1) {
-            perror("unable to open input file");
-            break;
+        struct multiboot mb;
+        if ((slot != -1) && multibootRead(spi, &mb)) {
+            fprintf(stderr, "no multiboot header in flash -- write one with --multiboot=\n");
+            return 1;
         }
-        struct stat stat;
-        if (fstat(fd, &stat) == -1) {
-            perror("unable to get bitstream file size");
-            break;
+
+        uint32_t image_length;
+        uint8_t *bfr;
+        if (job.count) {
+            // Patch the ROMs in first, then write the result like any
+            // other image.
+            bfr = patch_bitstream(op_filename, &job, &image_length);
+            if (!bfr) {
+                ret = 1;
+                break;
+            }
         }
+        else {
+            struct image *img = imageOpen(op_filename);
+            if (!img) {
+                perror("unable to open input file");
+                ret = 1;
+                break;
+            }
 
-        uint8_t *bfr = malloc(stat.st_size);
-        if (!bfr) {
-            perror("unable to alloc memory for buffer");
-            break;
+            // Without a slot or a delta mode the image is decoded
+            // straight into the flash, one sector at a time.
+            if ((slot == -1) && !manifest && !journal && !shadow) {
+                ret = imageWrite(spi, addr, img, quiet);
+                imageClose(&img);
+                break;
+            }
+
+            bfr = imageReadAll(img, &image_length);
+            imageClose(&img);
+            if (!bfr) {
+                fprintf(stderr, "unable to read from file\n");
+                ret = 1;
+                break;
+            }
         }
-        if (read(fd, bfr, stat.st_size) != stat.st_size) {
-            perror("unable to read from file");
+
+        // A slot is rewritten as a whole so its sectors can be shared
+        // with the header and its neighbours.
+        if (slot != -1) {
+            uint32_t slot_size = multibootSlotSize(&mb, slot, spiId(spi).bytes);
+            if (image_length > slot_size) {
+                fprintf(stderr, "%u byte image doesn't fit in slot %d @ 0x%06x (%u bytes)\n",
+                        image_length, slot, mb.slot[slot], slot_size);
+                ret = 1;
+            }
+            else
+                ret = multibootWriteSlot(spi, &mb, slot, bfr, image_length, quiet);
             free(bfr);
             break;
         }
-        close(fd);
-        spiWrite(spi, addr, bfr, stat.st_size, quiet);
+
+        if (rt)
+            rtPrefault(bfr, image_length);
+        if (!manifest && !journal && !shadow)
+            ret = spiWrite(spi, addr, bfr, image_length, quiet);
+        else if (manifest) {
+            // By default the manifest lives in the last sectors of the flash
+            if (manifest_addr == -1) {
+                struct spi_id id = spiId(spi);
+                if (id.bytes == -1) {
+                    fprintf(stderr, "unknown spi flash size -- specify with -b or --manifest=addr\n");
+                    free(bfr);
+                    return 1;
+                }
+                manifest_addr = id.bytes - FMANIFEST_SLOTS * spiEraseSize(spi);
+            }
+            ret = fmanifestWrite(spi, manifest_addr, addr, bfr, image_length, quiet);
+        }
+        else if (journal) {
+            if (!journal_path) {
+                char *path = malloc(strlen(op_filename) + sizeof(".journal"));
+                if (!path) {
+                    perror("unable to allocate memory for journal path");
+                    free(bfr);
+                    return 1;
+                }
+                sprintf(path, "%s.journal", op_filename);
+                journal_path = path;
+            }
+            ret = journalWrite(spi, journal_path, resume, addr, bfr, image_length, quiet);
+        }
+        else
+            ret = shadowWrite(spi, shadow_dir, addr, bfr, image_length, quiet);
+        free(bfr);
         break;
     }
 
     case OP_SPI_VERIFY: {
-        fd = open(op_filename, O_RDONLY);
-        if (fd == -1) {
+        if (slot != -1) {
+            struct multiboot mb;
+            if (multibootRead(spi, &mb)) {
+                fprintf(stderr, "no multiboot header in flash\n");
+                return 1;
+            }
+            addr = mb.slot[slot];
+        }
+
+        struct image *img = imageOpen(op_filename);
+        if (!img) {
             perror("unable to open input file");
+            ret = 1;
             break;
         }
-        struct stat stat;
-        if (fstat(fd, &stat) == -1) {
-            perror("unable to get bitstream file size");
-            break;
+
+        // Read back one chunk at a time so --fail-fast can stop early
+        struct verify_report report;
+        verifyInit(&report, stdout, spiEraseSize(spi), quiet);
+        ret = imageVerify(spi, addr, img, &report, fail_fast);
+        if (verifyFinish(&report))
+            ret = 1;
+        imageClose(&img);
+        break;
+    }
+
+    case OP_SPI_FINGERPRINT: {
+        struct spi_id id = spiId(spi);
+        uint32_t sector_size = spiEraseSize(spi);
+        if (length == -1) {
+            if (id.bytes == -1) {
+                fprintf(stderr, "unknown spi flash size -- specify with -b or -n\n");
+                return 1;
+            }
+            length = id.bytes - addr;
         }
 
-        uint8_t *file_src = malloc(stat.st_size);
-        uint8_t *spi_src = malloc(stat.st_size);
-        if (!file_src) {
-            perror("unable to alloc memory for buffer");
-            break;
+        uint8_t *bfr = malloc(sector_size);
+        if (!bfr) {
+            perror("unable to allocate memory for spi");
+            return 1;
         }
-        if (read(fd, file_src, stat.st_size) != stat.st_size) {
-            perror("unable to read from file");
-            free(file_src);
-            break;
+        if (rt)
+            rtPrefault(bfr, sector_size);
+
+        // Stream the range a sector at a time, so that per-sector
+        // digests fall out of the same pass as the whole-range ones.
+        // Reads follow the erase sectors, so only the first can be
+        // partial when -a isn't sector-aligned.
+        uint32_t crc = 0;
+        struct sha256_ctx sha;
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+        uint32_t offset;
+        uint32_t len;
+        digestSha256Init(&sha);
+        for (offset = 0; offset < length; offset += len) {
+            len = sector_size - ((addr + offset) % sector_size);
+            if (len > length - offset)
+                len = length - offset;
+            spiRead(spi, addr + offset, bfr, len);
+            if (fingerprint_per_sector)
+                printf("0x%08x", addr + offset);
+
+            // Each sector's CRC32 is folded into the range's, rather
+            // than running the bytes through the CRC twice
+            if (fingerprint_algs & FA_CRC32) {
+                uint32_t sector_crc = digestCrc32(0, bfr, len);
+                crc = digestCrc32Combine(crc, sector_crc, len);
+                if (fingerprint_per_sector)
+                    printf(" crc32=%08x", sector_crc);
+            }
+
+            // SHA-256 can't be combined, so the range's digest only sees
+            // the bytes again when a per-sector digest is wanted too
+            if (fingerprint_algs & FA_SHA256) {
+                digestSha256Update(&sha, bfr, len);
+                if (fingerprint_per_sector) {
+                    digestSha256(bfr, len, digest);
+                    digestToHex(digest, sizeof(digest), hex);
+                    printf(" sha256=%s", hex);
+                }
+            }
+            if (fingerprint_per_sector)
+                printf("\n");
         }
-        close(fd);
 
-        spiRead(spi, addr, spi_src, stat.st_size);
+        printf("range 0x%08x-0x%08x", addr, (uint32_t)(addr + length));
+        if (fingerprint_algs & FA_CRC32)
+            printf(" crc32=%08x", crc);
+        if (fingerprint_algs & FA_SHA256) {
+            digestSha256Final(&sha, digest);
+            digestToHex(digest, sizeof(digest), hex);
+            printf(" sha256=%s", hex);
+        }
+        printf("\n");
+        free(bfr);
+        break;
+    }
 
-        unsigned int offset;
-        for (offset = addr; offset < stat.st_size + addr; offset++) {
-            if (file_src[offset - addr] != spi_src[offset - addr]) {
-                ret++;
-                if (!quiet)
-                    printf("%9d: file: %02x   spi: %02x\n", offset, file_src[offset - addr], spi_src[offset - addr]);
-            }
+    case OP_SPI_SEGMENTS: {
+        struct segment_list segments;
+        struct verify_report report;
+        int i;
+
+        if (segmentsLoad(&segments, op_filename))
+            return 1;
+        if (!quiet)
+            for (i = 0; i < segments.count; i++)
+                printf("segment %d: 0x%08x-0x%08x (%u bytes)\n", i, segments.segs[i].addr,
+                       segments.segs[i].addr + segments.segs[i].length, segments.segs[i].length);
+
+        ret = segmentsWrite(spi, &segments, quiet);
+        if (!ret) {
+            verifyInit(&report, stdout, spiEraseSize(spi), quiet);
+            ret = segmentsVerify(spi, &segments, &report, fail_fast) ? 1 : 0;
+            if (verifyFinish(&report))
+                ret = 1;
         }
+        segmentsFree(&segments);
+        break;
+    }
+
+    case OP_MULTIBOOT: {
+        struct multiboot mb;
+        if (multiboot_spec) {
+            if (multibootParse(&mb, multiboot_spec))
+                return 1;
+            mb.coldboot = coldboot;
+            ret = multibootWrite(spi, &mb, quiet);
+            if (ret)
+                break;
+        }
+        if (multibootRead(spi, &mb)) {
+            fprintf(stderr, "no multiboot header in flash\n");
+            ret = 1;
+            break;
+        }
+        if (!quiet || !multiboot_spec)
+            multibootPrint(stdout, &mb);
         break;
     }
 
@@ -554,60 +1522,55 @@ int main(int argc, char **argv) {
     }
 
     case OP_FPGA_BOOT: {
-        int count;
-#ifndef DEBUG_ICE40_PATCH
-        spiHold(spi);
-        spiSwapTxRx(spi);
-        fpgaResetSlave(fpga);
-        fprintf(stderr, "FPGA Done? %d\n", fpgaDone(fpga));
-        spiBegin(spi);
-#endif
-        if (replacement_rom) {
-            IRW_FILE *bitstream = irw_open(op_filename, "r");
-            if (!bitstream) {
-                perror("unable to open fpga bitstream");
-                break;
-            }
-#ifdef DEBUG_ICE40_PATCH
-            IRW_FILE *spidev = irw_open("foboot-patched.bin", "w");
-            return ice40_patch(bitstream, replacement_rom, spidev, 8192);
-#else
-            IRW_FILE *spidev = irw_open_fake(spi, spi_irw_readb, spi_irw_writeb);
-#endif
-            ice40_patch(bitstream, replacement_rom, spidev, 8192);
+        ret = fpga_boot(spi, fpga, op_filename, &job);
+        if (!watch)
+            break;
+
+        struct ff_watch *w = watchAlloc();
+        int failed = !w || watchAdd(w, op_filename);
+        int i;
+        for (i = 0; !failed && (i < job.count); i++)
+            failed = watchAdd(w, job.filenames[i]);
+        if (failed) {
+            watchFree(&w);
+            ret = 1;
+            break;
         }
-        else {
-            uint8_t bfr[32768];
-            int fd = open(op_filename, O_RDONLY);
-            if (fd == -1) {
-                perror("unable to open fpga bitstream");
+        for (;;) {
+            fprintf(stderr, "watching %s for changes\n", op_filename);
+            if (watchWait(w, watch_ms))
                 break;
-            }
-            while ((count = read(fd, bfr, sizeof(bfr))) > 0) {
-                int i;
-                for (i = 0; i < count; i++)
-                    spiTx(spi, bfr[i]);
-            }
-            if (count < 0) {
-                perror("unable to read from fpga bitstream file");
-                break;
-            }
-            close(fd);
+            ret = fpga_boot(spi, fpga, op_filename, &job);
         }
-        for (count = 0; count < 500; count++)
-            spiTx(spi, 0xff);
-        fprintf(stderr, "FPGA Done? %d\n", fpgaDone(fpga));
-        spiEnd(spi);
+        watchFree(&w);
+        ret = 1;
+        break;
+    }
 
-        spiSwapTxRx(spi);
-        spiUnhold(spi);
+    case OP_FPGA_SEQUENCE: {
+        struct sequence seq;
+        if (seqLoad(&seq, op_filename))
+            return 1;
+        ret = seqRun(&seq, spi, fpga, uart_dev, quiet);
+        seqFree(&seq);
         break;
     }
 
-    case OP_FPGA_RESET:
+    case OP_FPGA_RESET: {
         printf("resetting fpga\n");
+
+        // Let go of the SPI bus so the FPGA can boot from the flash
+        spiFree(&spi);
         fpgaResetMaster(fpga);
+        int boot_us = fpgaWaitDone(fpga);
+        if (boot_us < 0) {
+            fprintf(stderr, "fpga did not assert CDONE -- is there a valid bitstream in flash?\n");
+            ret = 1;
+        }
+        else if (!quiet)
+            printf("fpga booted in %d us\n", boot_us);
         break;
+    }
 
     case OP_SET_QE:
         spiSetQe(spi);
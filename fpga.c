@@ -8,14 +8,26 @@
 #include <stdlib.h>
 
 #include "rpi.h"
+#include "spi.h"
 #include "fpga.h"
 
+// Clocks to send after the bitstream while waiting for CDONE, and the
+// clocks needed after CDONE to activate the I/O (49 minimum).
+#define FPGA_DONE_MAX_CLOCKS 4000
+#define FPGA_WAKEUP_CLOCKS 56
+
 struct ff_fpga {
     struct {
         int reset;
         int done;
         int cs;
     } pins;
+    struct {
+        uint32_t reset_low_us;
+        uint32_t config_wait_us;
+        uint32_t done_timeout_us;
+    } timing;
+    uint32_t reset_tick;    // gpioTick() when CRESET was last released
 };
 
 int fpgaDone(struct ff_fpga *fpga) {
@@ -33,12 +45,15 @@ int fpgaResetSlave(struct ff_fpga *fpga) {
     // Set CS to 0, which will put the FPGA into slave mode
     gpioWrite(fpga->pins.cs, 0);
 
-    usleep(10000); // XXX figure out correct sleep length here
+    usleep(fpga->timing.reset_low_us);
 
     // Bring the FPGA out of reset
     gpioWrite(fpga->pins.reset, 1);
+    fpga->reset_tick = gpioTick();
 
-    usleep(1200); // 13.2.SPI Slave Configuration Process
+    // Wait for the configuration memory to clear before sending any
+    // clocks (tCR_SCK, 13.2.SPI Slave Configuration Process)
+    usleep(fpga->timing.config_wait_us);
 
     // Release the CS pin
     // 2019/07/13: Don't release CS pin so as to prevent the SPI
@@ -60,16 +75,65 @@ int fpgaResetMaster(struct ff_fpga *fpga) {
     // Set CS to 1, which will put the FPGA into "self boot" mode
     gpioWrite(fpga->pins.cs, 1);
 
-    usleep(10000); // XXX figure out correct sleep length here
+    usleep(fpga->timing.reset_low_us);
 
     // Bring the FPGA out of reset
     gpioWrite(fpga->pins.reset, 1);
+    fpga->reset_tick = gpioTick();
 
-    usleep(1200); // 13.2.SPI Slave Configuration Process
+    // CS is only sampled as reset is released.  Let go of it so the
+    // FPGA can drive it while it reads the SPI flash (the pullup keeps
+    // it high until then).
+    gpioSetMode(fpga->pins.cs, PI_INPUT);
+
+    return 0;
+}
 
+int fpgaSlaveBegin(struct ff_fpga *fpga, struct ff_spi *spi) {
+    // Keep the FPGA off the bus while the flash is put to sleep
+    fpgaReset(fpga);
+    spiHold(spi);
+    spiSwapTxRx(spi);
+    fpgaResetSlave(fpga);
+    spiBegin(spi);
     return 0;
 }
 
+int fpgaSlaveFinish(struct ff_fpga *fpga, struct ff_spi *spi, int *clocks) {
+    int count;
+    int boot_us = -1;
+
+    // Keep clocking with MOSI high until CDONE rises, then give the
+    // FPGA the extra clocks it needs to release its I/O.
+    for (count = 0; (count < FPGA_DONE_MAX_CLOCKS) && !fpgaDone(fpga); count += 8)
+        spiClock(spi, 8);
+    if (fpgaDone(fpga))
+        boot_us = gpioTick() - fpga->reset_tick;
+    spiClock(spi, FPGA_WAKEUP_CLOCKS);
+    spiEnd(spi);
+
+    spiSwapTxRx(spi);
+    spiUnhold(spi);
+    if (clocks)
+        *clocks = count;
+    return boot_us;
+}
+
+int fpgaWaitDone(struct ff_fpga *fpga) {
+    uint32_t now;
+
+    do {
+        now = gpioTick();
+        if (gpioRead(fpga->pins.done))
+            return now - fpga->reset_tick;
+    } while ((now - fpga->reset_tick) < fpga->timing.done_timeout_us);
+    return -1;
+}
+
+uint32_t fpgaResetTick(struct ff_fpga *fpga) {
+    return fpga->reset_tick;
+}
+
 int fpgaReset(struct ff_fpga *fpga) {
     // Put the FPGA into reset
     gpioSetMode(fpga->pins.reset, PI_OUTPUT);
@@ -91,6 +155,9 @@ int fpgaInit(struct ff_fpga *fpga) {
 struct ff_fpga *fpgaAlloc(void) {
     struct ff_fpga *fpga = (struct ff_fpga *)malloc(sizeof(struct ff_fpga));
     memset(fpga, 0, sizeof(*fpga));
+    fpga->timing.reset_low_us = FPGA_RESET_LOW_US;
+    fpga->timing.config_wait_us = FPGA_CONFIG_WAIT_US;
+    fpga->timing.done_timeout_us = FPGA_DONE_TIMEOUT_US;
     return fpga;
 }
 
@@ -103,6 +170,15 @@ void fpgaSetPin(struct ff_fpga *fpga, enum fpga_pin pin, int val) {
     }
 }
 
+void fpgaSetTiming(struct ff_fpga *fpga, enum fpga_timing timing, uint32_t us) {
+    switch (timing) {
+    case FT_RESET_LOW: fpga->timing.reset_low_us = us; break;
+    case FT_CONFIG_WAIT: fpga->timing.config_wait_us = us; break;
+    case FT_DONE_TIMEOUT: fpga->timing.done_timeout_us = us; break;
+    default: fprintf(stderr, "unrecognized timing: %d\n", timing); break;
+    }
+}
+
 void fpgaFree(struct ff_fpga **fpga) {
     if (!fpga)
         return;
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct ff_fpga;
+struct ff_spi;
 
 enum fpga_pin {
 	FP_RESET,
@@ -11,6 +12,19 @@ enum fpga_pin {
 	FP_CS,
 };
 
+// Reset timings, in microseconds.  The defaults are the iCE40 datasheet
+// minimums: CRESET_B low for 200 ns (rounded up to the 1 us usleep()
+// can do), and 1200 us from CRESET_B high before the first slave clock.
+enum fpga_timing {
+	FT_RESET_LOW,		// How long CRESET_B is held low
+	FT_CONFIG_WAIT,		// From CRESET_B high to the first slave clock
+	FT_DONE_TIMEOUT,	// How long fpgaWaitDone() waits for CDONE
+};
+
+#define FPGA_RESET_LOW_US	1
+#define FPGA_CONFIG_WAIT_US	1200
+#define FPGA_DONE_TIMEOUT_US	1000000
+
 #if 0
 enum spi_state {
 	SS_UNCONFIGURED = 0,
@@ -70,9 +84,23 @@ int fpgaResetMaster(struct ff_fpga *fpga);
 int fpgaReset(struct ff_fpga *fpga);
 int fpgaInit(struct ff_fpga *fpga);
 int fpgaDone(struct ff_fpga *fpga);
+// The gpioTick() at which the FPGA was last brought out of reset
+uint32_t fpgaResetTick(struct ff_fpga *fpga);
+// Poll CDONE until it rises, and return the microseconds since reset
+// was released, or -1 if it didn't rise within FT_DONE_TIMEOUT.
+int fpgaWaitDone(struct ff_fpga *fpga);
+
+// Put the SPI flash to sleep and reset the FPGA into slave mode, ready
+// for a bitstream to be sent with spiTxBuffer().
+int fpgaSlaveBegin(struct ff_fpga *fpga, struct ff_spi *spi);
+// Clock until CDONE rises, send the wake-up clocks and hand the bus back
+// to the flash.  Returns the microseconds from reset to CDONE, or -1 if
+// it never rose, and the number of trailing clocks in `clocks`.
+int fpgaSlaveFinish(struct ff_fpga *fpga, struct ff_spi *spi, int *clocks);
 
 struct ff_fpga *fpgaAlloc(void);
 void fpgaSetPin(struct ff_fpga *fpga, enum fpga_pin pin, int val);
+void fpgaSetTiming(struct ff_fpga *fpga, enum fpga_timing timing, uint32_t us);
 void fpgaFree(struct ff_fpga **fpga);
 
 #endif /* BB_FPGA_H_ */
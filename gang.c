@@ -0,0 +1,573 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rpi.h"
+#include "spi.h"
+#include "memscan.h"
+#include "verify.h"
+#include "gang.h"
+
+#define GANG_PAGE_SIZE 256
+
+// Bytes read back from every device between compares
+#define GANG_READ_CHUNK 4096
+
+struct ff_gang_device {
+    int mosi;
+    int miso;
+    int cs;                 // -1 if on the shared CS line
+    uint32_t mosi_bit;
+    uint8_t id[3];          // JEDEC ID from 0x9f
+    const char *error;      // Why this device failed, or NULL
+    struct verify_report verify;
+};
+
+struct ff_gang {
+    int clk;
+    int cs;
+    int wp;
+    int hold;
+    uint32_t sector_size;
+    uint8_t unlock_cmd;     // Sent before each erase, as spiErase() does
+    uint32_t clk_bit;
+    uint32_t mosi_bits;     // Every device's MOSI
+    uint32_t miso_lanes;    // Bit n is set if a MISO is in BCM 8n..8n+7
+    int count;
+    struct ff_gang_device dev[GANG_MAX_DEVICES];
+};
+
+static void gang_fail(struct ff_gang *g, int d, const char *error) {
+    if (!g->dev[d].error)
+        g->dev[d].error = error;
+}
+
+static int gang_passing(struct ff_gang *g) {
+    int d;
+    int passing = 0;
+    for (d = 0; d < g->count; d++)
+        if (!g->dev[d].error)
+            passing++;
+    return passing;
+}
+
+// CS lines to drive: the shared one, plus the private CS of each device
+// that is still passing, so a failed device is left deselected.
+static uint32_t gang_cs_bits(struct ff_gang *g) {
+    uint32_t bits = 1 << g->cs;
+    int d;
+    for (d = 0; d < g->count; d++)
+        if ((g->dev[d].cs != -1) && !g->dev[d].error)
+            bits |= 1 << g->dev[d].cs;
+    return bits;
+}
+
+static void gang_begin(struct ff_gang *g) {
+    gpioClearBank1(gang_cs_bits(g));
+    gpioReadBank1();
+}
+
+static void gang_end(struct ff_gang *g) {
+    uint32_t bits = 1 << g->cs;
+    int d;
+    for (d = 0; d < g->count; d++)
+        if (g->dev[d].cs != -1)
+            bits |= 1 << g->dev[d].cs;
+    gpioSetBank1(bits);
+    gpioReadBank1();
+}
+
+// Clock out `count` bytes to every device at once, where data[d] is the
+// stream for device d.  Each bit of every device is bit-sliced into one
+// set mask and one clear mask, and CLK falls in the same write that
+// clears the zeros.  A bit costs three bank writes and two GPLEV0
+// read-backs for any number of devices: one read after the data is set
+// up with CLK low, and one after CLK rises, as in spiTxBuffer(), so a
+// gang on one heavily loaded CLK never runs faster than the bus.
+static void gang_tx(struct ff_gang *g, const uint8_t *const *data, uint32_t count) {
+    uint32_t i;
+    int bit;
+    int d;
+
+    for (i = 0; i < count; i++) {
+        uint32_t set[8] = { 0 };
+        for (d = 0; d < g->count; d++) {
+            uint8_t b = data[d][i];
+            for (bit = 0; bit < 8; bit++)
+                if (b & (1 << bit))
+                    set[bit] |= g->dev[d].mosi_bit;
+        }
+        for (bit = 7; bit >= 0; bit--) {
+            gpioClearBank1(g->clk_bit | (g->mosi_bits & ~set[bit]));
+            gpioSetBank1(set[bit]);
+            gpioReadBank1();
+            gpioSetBank1(g->clk_bit);
+            gpioReadBank1();
+        }
+    }
+    gpioClearBank1(g->clk_bit);
+    gpioReadBank1();
+}
+
+// Send the same byte to every device, e.g. a command or an address
+static void gang_command(struct ff_gang *g, uint8_t cmd) {
+    int bit;
+    for (bit = 7; bit >= 0; bit--) {
+        if (cmd & (1 << bit)) {
+            gpioClearBank1(g->clk_bit);
+            gpioSetBank1(g->mosi_bits);
+        }
+        else
+            gpioClearBank1(g->clk_bit | g->mosi_bits);
+        gpioReadBank1();
+        gpioSetBank1(g->clk_bit);
+        gpioReadBank1();
+    }
+    gpioClearBank1(g->clk_bit);
+    gpioReadBank1();
+}
+
+// Clock in `count` bits, keeping a sample of the whole GPIO level
+// register for each, so that one read captures a bit from every device.
+static void gang_sample(struct ff_gang *g, uint32_t *samples, uint32_t count) {
+    uint32_t i;
+
+    gpioSetBank1(g->mosi_bits);
+    for (i = 0; i < count; i++) {
+        gpioSetBank1(g->clk_bit);
+        samples[i] = gpioReadBank1();
+        gpioClearBank1(g->clk_bit);
+        gpioReadBank1();
+    }
+}
+
+// Un-bit-slice eight samples (MSB first) into one byte per GPIO.  Each
+// byte lane of the samples that holds a MISO forms an 8x8 bit matrix,
+// one row per sample, and transposing it in a 64-bit word with three
+// swap steps turns each column, a pin's eight bits, into a row.
+static void gang_transpose(const uint32_t *samples, uint32_t lanes, uint8_t *pins) {
+    int lane;
+    int i;
+
+    for (lane = 0; lane < 4; lane++) {
+        uint64_t x = 0;
+        uint64_t t;
+
+        if (!(lanes & (1 << lane)))
+            continue;
+        for (i = 0; i < 8; i++)
+            x |= (uint64_t)((samples[i] >> (lane * 8)) & 0xff) << ((7 - i) * 8);
+
+        t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+        x ^= t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+        x ^= t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+        x ^= t ^ (t << 28);
+
+        for (i = 0; i < 8; i++)
+            pins[lane * 8 + i] = x >> (i * 8);
+    }
+}
+
+// Receive `count` bytes from every device into out[d].
+static void gang_read_bytes(struct ff_gang *g, uint8_t *const *out, uint32_t count) {
+    uint32_t samples[GANG_PAGE_SIZE * 8];
+    uint8_t pins[32];
+    uint32_t offset;
+    uint32_t i;
+    int d;
+
+    for (offset = 0; offset < count; offset += GANG_PAGE_SIZE) {
+        uint32_t len = count - offset;
+        if (len > GANG_PAGE_SIZE)
+            len = GANG_PAGE_SIZE;
+        gang_sample(g, samples, len * 8);
+        for (i = 0; i < len; i++) {
+            gang_transpose(samples + i * 8, g->miso_lanes, pins);
+            for (d = 0; d < g->count; d++)
+                out[d][offset + i] = pins[g->dev[d].miso];
+        }
+    }
+}
+
+// Receive one byte from every device.
+static void gang_rx(struct ff_gang *g, uint8_t *out) {
+    uint32_t samples[8];
+    uint8_t pins[32];
+    int d;
+
+    gang_sample(g, samples, 8);
+    gang_transpose(samples, g->miso_lanes, pins);
+    for (d = 0; d < g->count; d++)
+        out[d] = pins[g->dev[d].miso];
+}
+
+static void gang_read_status(struct ff_gang *g, uint8_t *sr1) {
+    gang_begin(g);
+    gang_command(g, 0x05);
+    gang_rx(g, sr1);
+    gang_end(g);
+}
+
+// Poll until every passing device has finished, so the gang runs at the
+// pace of its slowest member.  Devices that are still busy when the
+// timeout expires are failed.  Returns the number still busy.
+static int gang_wait_for_not_busy(struct ff_gang *g, uint32_t timeout_ms) {
+    uint32_t start = gpioTick();
+    uint8_t sr1[GANG_MAX_DEVICES];
+    int busy;
+    int d;
+
+    do {
+        gang_read_status(g, sr1);
+        busy = 0;
+        for (d = 0; d < g->count; d++)
+            if (!g->dev[d].error && (sr1[d] & (1 << 0)))
+                busy++;
+        if (!busy)
+            return 0;
+    } while ((gpioTick() - start) < timeout_ms * 1000);
+
+    for (d = 0; d < g->count; d++)
+        if (sr1[d] & (1 << 0))
+            gang_fail(g, d, "never went not busy");
+    return busy;
+}
+
+static void gang_write_enable(struct ff_gang *g) {
+    uint8_t sr1[GANG_MAX_DEVICES];
+    int d;
+
+    gang_begin(g);
+    gang_command(g, 0x06);
+    gang_end(g);
+
+    gang_read_status(g, sr1);
+    for (d = 0; d < g->count; d++)
+        if (!(sr1[d] & (1 << 1)))
+            gang_fail(g, d, "write-enable latch (WEL) not set");
+}
+
+static void gang_address(struct ff_gang *g, uint8_t cmd, uint32_t addr) {
+    gang_command(g, cmd);
+    gang_command(g, addr >> 16);
+    gang_command(g, addr >> 8);
+    gang_command(g, addr >> 0);
+}
+
+// Clear the block protection bits, like spiUnlockProtection()
+static void gang_unlock(struct ff_gang *g) {
+    uint8_t ignored[GANG_MAX_DEVICES];
+
+    if (g->unlock_cmd == NO_UNLOCK_CMD)
+        return;
+    gang_begin(g);
+    gang_command(g, g->unlock_cmd);
+    gang_rx(g, ignored);
+    gang_end(g);
+}
+
+struct ff_gang *gangAlloc(struct ff_spi *spi) {
+    struct ff_gang *g = malloc(sizeof(*g));
+    if (!g)
+        return NULL;
+    memset(g, 0, sizeof(*g));
+    g->clk = spiGetPin(spi, SP_CLK);
+    g->cs = spiGetPin(spi, SP_CS);
+    g->wp = spiGetPin(spi, SP_WP);
+    g->hold = spiGetPin(spi, SP_HOLD);
+    g->clk_bit = 1 << g->clk;
+    g->sector_size = spiEraseSize(spi);
+    g->unlock_cmd = spiGetUnlockCmd(spi);
+    return g;
+}
+
+void gangFree(struct ff_gang **gang) {
+    if (!gang || !*gang)
+        return;
+    free(*gang);
+    *gang = NULL;
+}
+
+int gangAddDevice(struct ff_gang *g, int mosi, int miso, int cs) {
+    struct ff_gang_device *dev;
+
+    if (g->count >= GANG_MAX_DEVICES) {
+        fprintf(stderr, "gang: at most %d devices are supported\n", GANG_MAX_DEVICES);
+        return -1;
+    }
+    if ((mosi < 0) || (mosi > 31) || (miso < 0) || (miso > 31) || (cs < -1) || (cs > 31)) {
+        fprintf(stderr, "gang: pins must be in GPIO bank 1 (0-31)\n");
+        return -1;
+    }
+
+    dev = &g->dev[g->count++];
+    memset(dev, 0, sizeof(*dev));
+    dev->mosi = mosi;
+    dev->miso = miso;
+    dev->cs = cs;
+    dev->mosi_bit = 1 << mosi;
+    g->mosi_bits |= dev->mosi_bit;
+    g->miso_lanes |= 1 << (miso / 8);
+    return 0;
+}
+
+int gangParse(struct ff_gang *g, const char *spec) {
+    while (*spec) {
+        char *end;
+        int mosi, miso, cs = -1;
+
+        mosi = strtol(spec, &end, 0);
+        if ((end == spec) || (*end != ':'))
+            goto bad;
+        spec = end + 1;
+        miso = strtol(spec, &end, 0);
+        if (end == spec)
+            goto bad;
+        spec = end;
+        if (*spec == ':') {
+            spec++;
+            cs = strtol(spec, &end, 0);
+            if (end == spec)
+                goto bad;
+            spec = end;
+        }
+        if (*spec == ',')
+            spec++;
+        else if (*spec)
+            goto bad;
+        if (gangAddDevice(g, mosi, miso, cs))
+            return -1;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "gang: expected mosi:miso[:cs] at \"%s\"\n", spec);
+    return -1;
+}
+
+int gangCount(struct ff_gang *g) {
+    return g->count;
+}
+
+int gangInit(struct ff_gang *g) {
+    uint8_t id[3][GANG_MAX_DEVICES];
+    int d;
+    int i;
+
+    if ((g->clk > 31) || (g->cs > 31) || (g->wp > 31) || (g->hold > 31)) {
+        fprintf(stderr, "gang: pins must be in GPIO bank 1 (0-31)\n");
+        return g->count;
+    }
+
+    gpioSetMode(g->clk, PI_OUTPUT);
+    gpioSetMode(g->cs, PI_OUTPUT);
+    gpioSetMode(g->wp, PI_OUTPUT);
+    gpioSetMode(g->hold, PI_OUTPUT);
+    for (d = 0; d < g->count; d++) {
+        gpioSetMode(g->dev[d].mosi, PI_OUTPUT);
+        gpioSetMode(g->dev[d].miso, PI_INPUT);
+        if (g->dev[d].cs != -1)
+            gpioSetMode(g->dev[d].cs, PI_OUTPUT);
+    }
+    gpioClearBank1(g->clk_bit);
+    gpioSetBank1(g->mosi_bits | (1 << g->wp) | (1 << g->hold));
+    gang_end(g);
+
+    // Return every device to SPI mode and wake it from power-down
+    gang_begin(g);
+    for (i = 0; i < 8; i++)
+        gang_command(g, 0xff);
+    gang_end(g);
+    gang_begin(g);
+    gang_command(g, 0xab);
+    gang_end(g);
+    gang_wait_for_not_busy(g, 1000);
+
+    gang_begin(g);
+    gang_command(g, 0x9f);
+    for (i = 0; i < 3; i++)
+        gang_rx(g, id[i]);
+    gang_end(g);
+
+    for (d = 0; d < g->count; d++) {
+        for (i = 0; i < 3; i++)
+            g->dev[d].id[i] = id[i][d];
+        if (((id[0][d] == 0x00) && (id[1][d] == 0x00) && (id[2][d] == 0x00))
+         || ((id[0][d] == 0xff) && (id[1][d] == 0xff) && (id[2][d] == 0xff)))
+            gang_fail(g, d, "no response to JEDEC ID");
+    }
+    return g->count - gang_passing(g);
+}
+
+int gangWrite(struct ff_gang *g, uint32_t addr, const uint8_t *const *data, uint32_t count, int quiet) {
+    const uint8_t *page[GANG_MAX_DEVICES];
+    uint8_t *check[GANG_MAX_DEVICES];
+    uint8_t erase_cmd;
+    uint32_t erase_addr;
+    uint32_t offset;
+    int d;
+
+    if (addr & (GANG_PAGE_SIZE - 1)) {
+        fprintf(stderr, "Error: Target address is not page-aligned to 256 bytes\n");
+        return g->count;
+    }
+    switch (g->sector_size) {
+    case 65536: erase_cmd = 0xd8; break;
+    case 32768: erase_cmd = 0x52; break;
+    default:    erase_cmd = 0x20; break;
+    }
+
+    for (d = 0; d < g->count; d++) {
+        check[d] = malloc(g->sector_size);
+        if (!check[d]) {
+            while (d--)
+                free(check[d]);
+            perror("unable to allocate memory for erase check");
+            return g->count;
+        }
+    }
+
+    // Erase every sector the image touches, then read each one back, as
+    // spiErase() does, so a protected or worn-out chip fails here
+    for (erase_addr = addr & ~(g->sector_size - 1);
+         (erase_addr < addr + count) && gang_passing(g);
+         erase_addr += g->sector_size) {
+        if (!quiet) {
+            printf("\rErasing @ %06x / %06x", erase_addr, addr + count);
+            fflush(stdout);
+        }
+        gang_unlock(g);
+        gang_write_enable(g);
+        gang_begin(g);
+        gang_address(g, erase_cmd, erase_addr);
+        gang_end(g);
+        gang_wait_for_not_busy(g, 3000);
+
+        gangRead(g, erase_addr, check, g->sector_size);
+        for (d = 0; d < g->count; d++)
+            if (!g->dev[d].error && (memscanErased(check[d], g->sector_size) != g->sector_size))
+                gang_fail(g, d, "flash didn't erase");
+    }
+    for (d = 0; d < g->count; d++)
+        free(check[d]);
+    if (!quiet)
+        printf("  Done\n");
+
+    for (offset = 0; (offset < count) && gang_passing(g); offset += GANG_PAGE_SIZE) {
+        uint32_t len = count - offset;
+        int blank = 1;
+        if (len > GANG_PAGE_SIZE)
+            len = GANG_PAGE_SIZE;
+
+        // Pages that are erased in every image are left alone
+        for (d = 0; d < g->count; d++) {
+            page[d] = data[d] + offset;
+            if (!g->dev[d].error && (memscanErased(page[d], len) != len))
+                blank = 0;
+        }
+        if (blank)
+            continue;
+
+        if (!quiet && !(offset & (g->sector_size - 1))) {
+            printf("\rProgramming @ %06x / %06x", addr + offset, addr + count);
+            fflush(stdout);
+        }
+        gang_write_enable(g);
+        gang_begin(g);
+        gang_address(g, 0x02, addr + offset);
+        gang_tx(g, page, len);
+        gang_end(g);
+        gang_wait_for_not_busy(g, 100);
+    }
+    if (!quiet) {
+        printf("\rProgramming @ %06x / %06x", addr + count, addr + count);
+        printf("  Done\n");
+    }
+    return g->count - gang_passing(g);
+}
+
+int gangRead(struct ff_gang *g, uint32_t addr, uint8_t *const *data, uint32_t count) {
+    gang_begin(g);
+    gang_address(g, 0x0b, addr);
+    gang_command(g, 0x00);
+    gang_read_bytes(g, data, count);
+    gang_end(g);
+    return 0;
+}
+
+int gangVerify(struct ff_gang *g, uint32_t addr, const uint8_t *const *expected,
+               uint32_t count, int fail_fast) {
+    uint8_t *actual[GANG_MAX_DEVICES];
+    uint32_t offset;
+    int mismatched;
+    int d;
+
+    for (d = 0; d < g->count; d++) {
+        verifyInit(&g->dev[d].verify, stdout, g->sector_size, 1);
+        actual[d] = malloc(GANG_READ_CHUNK);
+        if (!actual[d]) {
+            while (d--)
+                free(actual[d]);
+            perror("unable to allocate memory for verify");
+            return g->count;
+        }
+    }
+
+    // One read command covers the whole range, and every chunk reads
+    // back all of the devices in the time it takes to read one.
+    gang_begin(g);
+    gang_address(g, 0x0b, addr);
+    gang_command(g, 0x00);
+    for (offset = 0; offset < count; offset += GANG_READ_CHUNK) {
+        uint32_t len = count - offset;
+        if (len > GANG_READ_CHUNK)
+            len = GANG_READ_CHUNK;
+        gang_read_bytes(g, actual, len);
+
+        mismatched = 0;
+        for (d = 0; d < g->count; d++) {
+            if (!g->dev[d].error)
+                verifyChunk(&g->dev[d].verify, addr + offset, expected[d] + offset, actual[d], len);
+            if (g->dev[d].error || g->dev[d].verify.errors)
+                mismatched++;
+        }
+        if (fail_fast && (mismatched == g->count))
+            break;
+    }
+    gang_end(g);
+
+    for (d = 0; d < g->count; d++) {
+        if (g->dev[d].verify.errors)
+            gang_fail(g, d, "verify mismatch");
+        free(actual[d]);
+    }
+    return g->count - gang_passing(g);
+}
+
+int gangReport(struct ff_gang *g, FILE *stream) {
+    int d;
+    int failed = 0;
+
+    for (d = 0; d < g->count; d++) {
+        struct ff_gang_device *dev = &g->dev[d];
+        fprintf(stream, "gang %d (mosi %d, miso %d", d, dev->mosi, dev->miso);
+        if (dev->cs != -1)
+            fprintf(stream, ", cs %d", dev->cs);
+        fprintf(stream, ") id %02x %02x %02x: ", dev->id[0], dev->id[1], dev->id[2]);
+        if (dev->error) {
+            fprintf(stream, "FAIL (%s", dev->error);
+            if (dev->verify.errors)
+                fprintf(stream, ": %u byte(s) in %u range(s), first at 0x%08x",
+                        dev->verify.errors, dev->verify.ranges, dev->verify.first_bad);
+            fprintf(stream, ")\n");
+            failed++;
+        }
+        else
+            fprintf(stream, "pass\n");
+    }
+    fprintf(stream, "gang: %d of %d device(s) passed\n", g->count - failed, g->count);
+    return failed;
+}
@@ -0,0 +1,51 @@
+#ifndef FF_GANG_H_
+#define FF_GANG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Every data line is driven from one 32-bit GPIO bank, so this is
+// limited by the number of free pins rather than by the mask width.
+#define GANG_MAX_DEVICES 12
+
+struct ff_spi;
+struct ff_gang;
+
+// A gang of flash chips that share CLK, WP and HOLD (and CS unless a
+// device is given its own) with `spi`, but each have their own MOSI
+// and MISO.  All pins must be in GPIO bank 1 (BCM 0-31).
+struct ff_gang *gangAlloc(struct ff_spi *spi);
+void gangFree(struct ff_gang **gang);
+
+// Add a device.  `cs` is -1 if the device uses the shared CS line.
+int gangAddDevice(struct ff_gang *gang, int mosi, int miso, int cs);
+
+// Add the devices in a spec of the form "mosi:miso[:cs],...".
+int gangParse(struct ff_gang *gang, const char *spec);
+
+int gangCount(struct ff_gang *gang);
+
+// Reset every device and read its JEDEC ID.  Devices that don't
+// respond are marked as failed.  Returns the number of failed devices.
+int gangInit(struct ff_gang *gang);
+
+// Erase and program every device in lock-step, where data[d] is the
+// image for device d (they may all point at the same image).
+// Returns the number of devices that failed.
+int gangWrite(struct ff_gang *gang, uint32_t addr, const uint8_t *const *data,
+              uint32_t count, int quiet);
+
+// Read `count` bytes from every device at once into data[d].
+int gangRead(struct ff_gang *gang, uint32_t addr, uint8_t *const *data, uint32_t count);
+
+// Compare every device against its own image, expected[d], reading
+// all of them back in a single pass.  With `fail_fast`, stop once every
+// device has a mismatch.  Returns the number of devices that failed.
+int gangVerify(struct ff_gang *gang, uint32_t addr, const uint8_t *const *expected,
+               uint32_t count, int fail_fast);
+
+// Print one line per device saying whether it passed, then a summary.
+// Returns the number of devices that failed.
+int gangReport(struct ff_gang *gang, FILE *stream);
+
+#endif /* FF_GANG_H_ */
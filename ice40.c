@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include "ice40.h"
+#include "bitstream.h"
 
 #define MAX(x, y) (x) > (y) ? (x) : (y)
 #define ARRAY_SIZE(x) ((sizeof(x) / sizeof(*x)))
@@ -62,20 +64,58 @@ struct Ice40Bitstream
     uint8_t frequency_range;
 };
 
-static void update_crc16(uint16_t *crc, uint8_t byte)
+// CRC-16-CCITT, MSB first.  crc16_table[k][b] is the CRC contribution
+// of byte b followed by k zero bytes, so eight bytes can be folded in
+// with eight independent lookups (slice-by-8).
+static uint16_t crc16_table[8][256];
+
+static void crc16_init(void)
+{
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint16_t c = i << 8;
+        for (j = 0; j < 8; j++)
+            c = (c & 0x8000) ? ((c << 1) ^ 0x1021) : (c << 1);
+        crc16_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crc16_table[j][i] = (crc16_table[j - 1][i] << 8)
+                              ^ crc16_table[0][crc16_table[j - 1][i] >> 8];
+}
+
+static inline void update_crc16(uint16_t *crc, uint8_t byte)
 {
     // CRC-16-CCITT, Initialize to 0xFFFF, No zero padding
-    for (int i = 7; i >= 0; i--)
-    {
-        uint16_t xor_value = ((*crc >> 15) ^ ((byte >> i) & 1)) ? 0x1021 : 0;
-        *crc = (*crc << 1) ^ xor_value;
+    *crc = (*crc << 8) ^ crc16_table[0][(*crc >> 8) ^ byte];
+}
+
+uint16_t ice40_crc16(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    if (!crc16_table[0][1])
+        crc16_init();
+
+    while (len >= 8) {
+        crc = crc16_table[7][p[0] ^ (crc >> 8)]
+            ^ crc16_table[6][p[1] ^ (crc & 0xff)]
+            ^ crc16_table[5][p[2]] ^ crc16_table[4][p[3]]
+            ^ crc16_table[3][p[4]] ^ crc16_table[2][p[5]]
+            ^ crc16_table[1][p[6]] ^ crc16_table[0][p[7]];
+        p += 8;
+        len -= 8;
     }
+    while (len--)
+        update_crc16(&crc, *p++);
+    return crc;
 }
 
-static uint32_t get_bit_offset(int x, int total_bits) {
-    // return (8192 * (x & 7)) + (x >> 3);
-    int bitshift = ffs(total_bits)-1;
-    return ((x * 8192) % total_bits) + ((x*8192) >> bitshift);
+static uint32_t get_bit_offset(uint32_t x, uint32_t total_bits) {
+    // ((x * 8192) % total_bits) + ((x * 8192) / total_bits), without
+    // overflowing for ROMs of 64 KiB and up
+    uint32_t rows = total_bits / 8192;
+    return (8192 * (x % rows)) + (x / rows);
 }
 
 uint32_t xorshift32(uint32_t x)
@@ -93,21 +133,273 @@ uint32_t get_rand(uint32_t x) {
     for (i = 0; i < 32; i++) {
         x = xorshift32(x);
         if ((x & 1) == 1)
-            out = out | (1 << i);
+            out = out | (1u << i);
     }
     return out;
 }
 
-static uint32_t fill_rand(uint32_t *bfr, int count) {
+// xorshift only shifts and XORs, so get_rand() is linear over GF(2):
+// its output is the XOR of its outputs for each set bit of the seed.
+// That lets it be evaluated a seed byte at a time from four tables
+// rather than with 32 xorshift steps.
+static uint32_t rand_table[4][256];
+
+static void rand_table_init(void)
+{
+    int byte, bit, v;
+    for (byte = 0; byte < 4; byte++) {
+        uint32_t basis[8];
+        for (bit = 0; bit < 8; bit++)
+            basis[bit] = get_rand(1u << (byte * 8 + bit));
+        for (v = 0; v < 256; v++) {
+            uint32_t out = 0;
+            for (bit = 0; bit < 8; bit++)
+                if (v & (1 << bit))
+                    out ^= basis[bit];
+            rand_table[byte][v] = out;
+        }
+    }
+}
+
+static inline uint32_t fast_rand(uint32_t x)
+{
+    return rand_table[0][x & 0xff] ^ rand_table[1][(x >> 8) & 0xff]
+         ^ rand_table[2][(x >> 16) & 0xff] ^ rand_table[3][x >> 24];
+}
+
+static uint32_t fill_rand(uint32_t *bfr, int count, uint32_t seed) {
     int i;
-    uint32_t last = 1;
+    uint32_t last = seed;
+    if (!rand_table[0][1])
+        rand_table_init();
     for (i = 0; i < count / 4; i++) {
-        last = get_rand(last);
+        last = fast_rand(last);
         bfr[i] = last;
     }
     return i;
 }
 
+// Transpose an 8x8 bit matrix, where bit c of byte r moves to bit r of
+// byte c.
+static inline uint64_t transpose8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+// Spray `in` the way it ends up in the FPGA's BRAM: it is split into
+// rows of 8192 bits, and bit c of row r becomes output bit (c * rows + r).
+// That's a bit-matrix transpose, so when there are a multiple of eight
+// rows it is done as 8x8 transposes of a byte from each of eight rows.
+static void spray(uint8_t *out, const uint8_t *in, uint32_t bytes)
+{
+    uint32_t rows = bytes / 1024;
+    uint32_t groups = rows / 8;
+    uint32_t g, j, r;
+
+    if (rows % 8) {
+        uint32_t x;
+        memset(out, 0, bytes);
+        for (x = 0; x < bytes * 8; x++) {
+            uint32_t src = get_bit_offset(x, bytes * 8);
+            if (in[src >> 3] & (1 << (src & 7)))
+                out[x >> 3] |= 1 << (x & 7);
+        }
+        return;
+    }
+
+    for (g = 0; g < groups; g++) {
+        for (j = 0; j < 1024; j++) {
+            uint64_t x = 0;
+            for (r = 0; r < 8; r++)
+                x |= (uint64_t)in[(g * 8 + r) * 1024 + j] << (r * 8);
+            x = transpose8(x);
+            for (r = 0; r < 8; r++)
+                out[(j * 8 + r) * groups + g] = x >> (r * 8);
+        }
+    }
+}
+
+// A sprayed reference pattern, along with every word in it sorted by
+// value so a BRAM block can be found wherever it sits in the pattern.
+struct ref_pattern {
+    uint32_t bytes;
+    uint32_t seed;
+    uint16_t *words;
+    uint64_t *index;    // (word << 32) | position
+    unsigned int pass;  // The last ice40_patch_record() call to use it
+};
+
+// Reference patterns only depend on their size and seed, so keep them
+// around for repeated patches (e.g. reloading with --watch).  Patterns
+// handed out during the current pass are never evicted, since the ROMs
+// they were returned for are still using them.
+static struct ref_pattern ref_cache[ICE40_MAX_ROMS];
+static unsigned int ref_cache_next;
+static unsigned int ref_cache_pass;
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static const struct ref_pattern *reference_pattern(uint32_t bytes, uint32_t seed)
+{
+    struct ref_pattern *ref;
+    uint32_t *rand;
+    uint32_t i;
+
+    for (i = 0; i < ARRAY_SIZE(ref_cache); i++) {
+        ref = &ref_cache[i];
+        if (ref->words && (ref->bytes == bytes) && (ref->seed == seed)) {
+            ref->pass = ref_cache_pass;
+            return ref;
+        }
+    }
+
+    // There are as many slots as ROMs in one pass, so one is always free
+    for (i = 0; i < ARRAY_SIZE(ref_cache); i++) {
+        ref = &ref_cache[ref_cache_next++ % ARRAY_SIZE(ref_cache)];
+        if (!ref->words || (ref->pass != ref_cache_pass))
+            break;
+    }
+    if (i == ARRAY_SIZE(ref_cache))
+        return NULL;
+    free(ref->words);
+    free(ref->index);
+    ref->bytes = bytes;
+    ref->seed = seed;
+    ref->pass = ref_cache_pass;
+    ref->words = malloc(bytes);
+    ref->index = malloc(bytes / sizeof(uint16_t) * sizeof(uint64_t));
+    rand = calloc(bytes / sizeof(uint32_t), sizeof(uint32_t));
+    if (!ref->words || !ref->index || !rand) {
+        free(rand);
+        free(ref->words);
+        free(ref->index);
+        ref->words = NULL;
+        ref->index = NULL;
+        return NULL;
+    }
+    fill_rand(rand, bytes, seed);
+    spray((uint8_t *)ref->words, (uint8_t *)rand, bytes);
+    free(rand);
+
+    for (i = 0; i < bytes / sizeof(uint16_t); i++)
+        ref->index[i] = ((uint64_t)ref->words[i] << 32) | i;
+    qsort(ref->index, bytes / sizeof(uint16_t), sizeof(*ref->index), compare_u64);
+    return ref;
+}
+
+struct word_mapping {
+    int bitstream;
+    int random;
+    int stride;
+};
+
+// Look for the reference pattern `ref` (`words` long) at word `base`
+// in the first words of a BRAM block.  Returns the stride of the
+// mapping, or -1 if the block doesn't match.
+static int find_mapping(const uint16_t scan_buffer[128], const uint16_t *ref,
+                        uint32_t words, uint32_t base, struct word_mapping word_mappings[16])
+{
+    int outer_word;
+    int word_stride = -1;
+    for (outer_word = 0; outer_word < 16; outer_word++) {
+        uint32_t inner_word;
+        word_mappings[outer_word].bitstream = -1;
+        word_mappings[outer_word].random = -1;
+        word_mappings[outer_word].stride = -1;
+        for (inner_word = 0; inner_word < 16; inner_word++) {
+            // Blocks past the end of the ROM are never patched
+            if (base + inner_word + 32 >= words)
+                break;
+            // We have a candidate offset.  Figure out what its stride is,
+            // and validate that we have multiple matches.
+            if (scan_buffer[outer_word] == ref[base + inner_word]) {
+                SCAN_DEBUG_PRINT("Candidate %04x @ %d/%d\n", scan_buffer[outer_word], outer_word, inner_word);
+                int scan_offset = 0;
+                for (scan_offset = 0; scan_offset < 30; scan_offset++) {
+                    if ((scan_buffer[outer_word + scan_offset] == ref[base + inner_word + 16])
+                    &&  (scan_buffer[outer_word + (scan_offset*2)] == ref[base + inner_word + 32])) {
+                        SCAN_DEBUG_PRINT("Scan offset: %d\n", scan_offset);
+                        word_mappings[outer_word].bitstream = outer_word;
+                        word_mappings[outer_word].random = inner_word;
+                        word_mappings[outer_word].stride = scan_offset;
+                    }
+                }
+            }
+        }
+    }
+    for (outer_word = 0; outer_word < 16; outer_word++) {
+        if (word_mappings[outer_word].stride != -1) {
+            if (word_stride != -1) {
+                if (word_mappings[outer_word].stride != word_stride) {
+                    printf("This stride is different (%d vs expected %d)\n", word_mappings[outer_word].stride, word_stride);
+                }
+            }
+            word_stride = word_mappings[outer_word].stride;
+        }
+    }
+
+#ifdef SCAN_DEBUG
+    for (outer_word = 0; outer_word < 16; outer_word++) {
+        SCAN_DEBUG_PRINT("word_mappings[%2d]:  bitstream: %2d  random: %2d  stride: %2d\n",
+        outer_word, word_mappings[outer_word].bitstream,
+        word_mappings[outer_word].random, word_mappings[outer_word].stride);
+    }
+#endif /* SCAN_DEBUG */
+    return word_stride;
+}
+
+// Find a BRAM block anywhere in a reference pattern, for ROMs that don't
+// start at the beginning of a bank.  Each of the first few words is
+// looked up in the index, and every place it appears is tried as the
+// start of a 16-word group.
+static int search_mapping(const uint16_t scan_buffer[128], const struct ref_pattern *ref,
+                          uint32_t *base, struct word_mapping word_mappings[16])
+{
+    uint32_t words = ref->bytes / sizeof(uint16_t);
+    int outer_word;
+
+    for (outer_word = 0; outer_word < 16; outer_word++) {
+        uint64_t key = (uint64_t)scan_buffer[outer_word] << 32;
+        uint32_t lo = 0, hi = words;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ref->index[mid] < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; (lo < words) && ((ref->index[lo] >> 32) == scan_buffer[outer_word]); lo++) {
+            uint32_t candidate = (uint32_t)ref->index[lo] & ~15;
+            int stride = find_mapping(scan_buffer, ref->words, words, candidate, word_mappings);
+            if (stride != -1) {
+                *base = candidate;
+                return stride;
+            }
+        }
+    }
+    return -1;
+}
+
+uint32_t ice40_rom_size(uint32_t length)
+{
+    uint32_t size = ICE40_MIN_ROM_SIZE;
+    while ((size < length) && (size < ICE40_MAX_ROM_SIZE))
+        size <<= 1;
+    return size;
+}
+
 uint32_t swap_u32(uint32_t word) {
     return (((word >> 24) & 0x000000ff)
              | ((word >> 8) & 0x0000ff00)
@@ -120,43 +412,110 @@ struct irw_file *irw_open(const char *filename, const char *mode)
     FILE *tmpfile = fopen(filename, mode);
     if (!tmpfile)
         return NULL;
+    if (!crc16_table[0][1])
+        crc16_init();
     struct irw_file *f = malloc(sizeof(*f));
-    memset(f, 0, sizeof(*f));
+    memset(f, 0, offsetof(struct irw_file, buf));
     f->f = tmpfile;
+    f->writing = (mode[0] == 'w') || (mode[0] == 'a');
     return f;
 }
 
-struct irw_file *irw_open_fake(void *hook_data,
-                               int (*read_hook)(void *data),
-                               int (*write_hook)(void *data, uint8_t b)) {
-   struct irw_file *f = malloc(sizeof(*f));
-    memset(f, 0, sizeof(*f));
-    f->read_hook = read_hook;
-    f->write_hook = write_hook;
+struct irw_file *irw_open_block(void *hook_data,
+                                int (*write_block_hook)(void *data, const uint8_t *b,
+                                                        size_t count)) {
+    struct irw_file *f = malloc(sizeof(*f));
+    if (!crc16_table[0][1])
+        crc16_init();
+    memset(f, 0, offsetof(struct irw_file, buf));
+    f->write_block_hook = write_block_hook;
     f->hook_data = hook_data;
+    f->writing = 1;
     return f;
 }
 
+static size_t irw_fill(struct irw_file *f)
+{
+    if (!f->f)
+        return 0;
+    f->buf_pos = 0;
+    f->buf_len = fread(f->buf, 1, sizeof(f->buf), f->f);
+    return f->buf_len;
+}
+
 int irw_readb(struct irw_file *f)
 {
     int val;
-    if (f->read_hook)
-        val = f->read_hook(f->hook_data);
+    if ((f->buf_pos < f->buf_len) || irw_fill(f))
+        val = f->buf[f->buf_pos++];
     else
-        val = fgetc(f->f);
+        val = EOF;
     if (val == EOF)
         return EOF;
     update_crc16(&f->crc, val);
     return val;
 }
 
+size_t irw_read(struct irw_file *f, uint8_t *data, size_t count)
+{
+    size_t done = 0;
+
+    while (done < count) {
+        size_t n;
+        if ((f->buf_pos == f->buf_len) && !irw_fill(f))
+            break;
+        n = f->buf_len - f->buf_pos;
+        if (n > count - done)
+            n = count - done;
+        memcpy(data + done, f->buf + f->buf_pos, n);
+        f->buf_pos += n;
+        done += n;
+    }
+    f->crc = ice40_crc16(f->crc, data, done);
+    return done;
+}
+
+static int irw_write_through(struct irw_file *f, const uint8_t *data, size_t count)
+{
+    if (f->write_block_hook)
+        return f->write_block_hook(f->hook_data, data, count) ? EOF : 0;
+    if (f->f && (fwrite(data, 1, count, f->f) != count))
+        return EOF;
+    return 0;
+}
+
+int irw_flush(struct irw_file *f)
+{
+    int ret = 0;
+    if (f->writing && f->buf_len)
+        ret = irw_write_through(f, f->buf, f->buf_len);
+    f->buf_len = 0;
+    return ret;
+}
+
 int irw_writeb(struct irw_file *f, int c) {
     update_crc16(&f->crc, c);
 
-    if (f->write_hook)
-        return f->write_hook(f->hook_data, c);
-    else
-        return fputc(c, f->f);
+    if ((f->buf_len == sizeof(f->buf)) && irw_flush(f))
+        return EOF;
+    f->buf[f->buf_len++] = c;
+    return c & 0xff;
+}
+
+int irw_write(struct irw_file *f, const uint8_t *data, size_t count)
+{
+    f->crc = ice40_crc16(f->crc, data, count);
+
+    // Anything that would fill the buffer anyway goes straight out
+    if (f->buf_len + count > sizeof(f->buf)) {
+        if (irw_flush(f))
+            return EOF;
+        if (count >= sizeof(f->buf))
+            return irw_write_through(f, data, count);
+    }
+    memcpy(f->buf + f->buf_len, data, count);
+    f->buf_len += count;
+    return 0;
 }
 
 void irw_close(struct irw_file **f) {
@@ -164,87 +523,175 @@ void irw_close(struct irw_file **f) {
         return;
     if (!*f)
         return;
-    if (!(*f)->f)
-        return;
-    fclose((*f)->f);
+    irw_flush(*f);
+    if ((*f)->f)
+        fclose((*f)->f);
+    free(*f);
     *f = NULL;
 }
 
-uint8_t get_bit(uint32_t *field, uint32_t offset)
+// Append a ROM to the arena, followed by room for its sprayed copy.
+// Returns the size of the ROM in the bitstream, or 0 on error.
+static uint32_t load_rom(struct ice40_rom *rom, uint8_t **arena, uint32_t *arena_len)
+{
+    uint32_t start = *arena_len;
+    uint32_t rom_length = 0;
+    uint32_t byte_count = rom->size;
+    uint8_t *grown;
+
+    // Read the ROM onto the end of the arena, which is then grown to
+    // hold both the ROM and its sprayed copy.
+    while (1) {
+        size_t n;
+        grown = realloc(*arena, start + rom_length + IRW_BUFFER_SIZE);
+        if (!grown) {
+            fprintf(stderr, "unable to allocate memory for rom\n");
+            return 0;
+        }
+        *arena = grown;
+        n = irw_read(rom->file, *arena + start + rom_length, IRW_BUFFER_SIZE);
+        rom_length += n;
+        if (n < IRW_BUFFER_SIZE)
+            break;
+        if (rom_length > ICE40_MAX_ROM_SIZE) {
+            fprintf(stderr, "rom is larger than %d bytes\n", ICE40_MAX_ROM_SIZE);
+            return 0;
+        }
+    }
+    DEBUG_PRINT("read %d bytes from rom\n", rom_length);
+
+    if (!byte_count)
+        byte_count = ICE40_DEFAULT_ROM_SIZE;
+    else if (byte_count == ICE40_ROM_SIZE_AUTO)
+        byte_count = ice40_rom_size(rom_length);
+    if ((byte_count < ICE40_MIN_ROM_SIZE) || (byte_count > ICE40_MAX_ROM_SIZE)
+     || (byte_count & (byte_count - 1))) {
+        fprintf(stderr, "rom size must be a power of two from %d to %d bytes\n",
+                ICE40_MIN_ROM_SIZE, ICE40_MAX_ROM_SIZE);
+        return 0;
+    }
+    if (rom_length > byte_count) {
+        fprintf(stderr, "input file is larger than %d bytes\n", byte_count);
+        return 0;
+    }
+
+    grown = realloc(*arena, start + 2 * byte_count);
+    if (!grown) {
+        fprintf(stderr, "unable to allocate memory for rom\n");
+        return 0;
+    }
+    *arena = grown;
+    memset(*arena + start + rom_length, 0, byte_count - rom_length);
+    *arena_len = start + 2 * byte_count;
+    return byte_count;
+}
+
+struct rom_patch {
+    uint32_t offset;    // Of the ROM in the arena; its spray follows
+    uint32_t bytes;
+    const struct ref_pattern *ref;
+    unsigned int blocks;
+};
+
+// Load every ROM into a single arena, each followed by its sprayed copy.
+// Returns the arena, or NULL on error.
+static uint8_t *load_roms(struct ice40_rom *roms, int rom_count, struct rom_patch *patches)
 {
-    // printf("offset&31: %d\n", offset & 31);
-    // printf("offset/sizeof(*field): %d\n", offset >> 5);
-    assert(offset < 65536);
-    return !!(field[offset >> 5] & (1 << (offset & 31)));
+    uint8_t *arena = NULL;
+    uint32_t arena_len = 0;
+    int r;
+
+    if ((rom_count < 1) || (rom_count > ICE40_MAX_ROMS)) {
+        fprintf(stderr, "between 1 and %d roms can be patched at once\n", ICE40_MAX_ROMS);
+        return NULL;
+    }
+
+    for (r = 0; r < rom_count; r++) {
+        patches[r].offset = arena_len;
+        patches[r].bytes = load_rom(&roms[r], &arena, &arena_len);
+        patches[r].ref = NULL;
+        patches[r].blocks = 0;
+        if (!patches[r].bytes) {
+            free(arena);
+            return NULL;
+        }
+    }
+
+    // Spray the ROMs like they would exist in the FPGA
+    for (r = 0; r < rom_count; r++)
+        spray(arena + patches[r].offset + patches[r].bytes, arena + patches[r].offset,
+              patches[r].bytes);
+    return arena;
 }
 
-void set_bit(uint32_t *field, uint32_t offset)
+// Note where a ROM was found, so it can be patched again without a scan
+static int record_map(struct ice40_bram_map **maps, int *map_count, uint32_t bank,
+                      uint32_t offset, int rom, uint32_t base, int stride,
+                      const struct word_mapping *word_mappings)
 {
-    assert(offset < 65536);
-    field[offset >> 5] |= (1 << (offset & 31));
+    struct ice40_bram_map *map;
+    int i;
+
+    if (stride > ICE40_BRAM_LANES) {
+        fprintf(stderr, "bank %u offset 0x%x: stride %d is too wide to record\n",
+                bank, offset, stride);
+        return -1;
+    }
+    map = realloc(*maps, (*map_count + 1) * sizeof(*map));
+    if (!map) {
+        fprintf(stderr, "unable to allocate memory for bram map\n");
+        return -1;
+    }
+    *maps = map;
+    map += (*map_count)++;
+    memset(map, 0, sizeof(*map));
+    map->bank = bank;
+    map->offset = offset;
+    map->rom = rom;
+    map->base = base;
+    map->stride = stride;
+    for (i = 0; i < ICE40_BRAM_LANES; i++)
+        map->lane[i] = (i < stride) ? word_mappings[i].random : -1;
+    return 0;
 }
 
-void clear_bit(uint32_t *field, uint32_t offset)
+int ice40_patch(struct irw_file *f, struct ice40_rom *roms, int rom_count,
+                struct irw_file *o)
 {
-    assert(offset < 65536);
-    field[offset >> 5] &= ~(1 << (offset & 31));
+    return ice40_patch_record(f, roms, rom_count, o, NULL, NULL);
 }
 
-int ice40_patch(struct irw_file *f, struct irw_file *rom,
-                struct irw_file *o, uint32_t byte_count)
+int ice40_patch_record(struct irw_file *f, struct ice40_rom *roms, int rom_count,
+                       struct irw_file *o, struct ice40_bram_map **maps, int *map_count)
 {
     uint32_t preamble = 0;
     uint8_t wakeup = 0;
     struct Ice40Bitstream bs;
-    uint32_t input_rom[byte_count / sizeof(uint32_t)];
-    uint32_t input_rand[byte_count / sizeof(uint32_t)];
-    uint32_t output_rand[byte_count / sizeof(uint32_t)];
-    uint32_t output_rom[byte_count / sizeof(uint32_t)];
-    uint8_t *i8 = (uint8_t *)input_rom;
-    uint16_t *ora16 = (uint16_t *)output_rand;
-    uint16_t *oro16 = (uint16_t *)output_rom;
+    struct rom_patch patches[ICE40_MAX_ROMS];
+    uint8_t *arena;
+    uint32_t rom_words = 0;
+    const uint16_t *ora16 = NULL;
+    const uint16_t *oro16 = NULL;
     unsigned int ora_ptr = 0;
-    unsigned int input_ptr;
     int b;
+    int r;
     int errors = 0;
 
     memset(&bs, 0, sizeof(bs));
 
-    // Read the ROM into a source buffer
-    memset(input_rom, 0, sizeof(input_rom));
-    input_ptr = 0;
-    while (((b = irw_readb(rom)) != EOF) && input_ptr <= byte_count)
-        i8[input_ptr++] = b;
-    if (input_ptr > byte_count) {
-        fprintf(stderr, "input file is larger than %d bytes\n", byte_count);
+    arena = load_roms(roms, rom_count, patches);
+    if (!arena)
         return -1;
-    }
-    DEBUG_PRINT("read %d bytes from rom\n", input_ptr);
-
-    // Generate our reference pattern
-    memset(input_rand, 0, sizeof(input_rand));
-    fill_rand(input_rand, sizeof(input_rand));
-
-    // Swap either the input or output data, as necessary
-    for (input_ptr = 0; input_ptr < sizeof(input_rom)/4; input_ptr++) {
-        // input_rand[input_ptr] = swap_u32(input_rand[input_ptr]);
-        // input_rom[input_ptr] = swap_u32(input_rom[input_ptr]);
-    }
-
-    // Spray the reference pattern and ROM like they would exist in the FPGA
-    for (input_ptr = 0; input_ptr < sizeof(input_rom) * 8; input_ptr++) {
-        int bit;
-        bit = get_bit(input_rand, get_bit_offset(input_ptr, sizeof(input_rand)*8));
-        if (bit)
-            set_bit(output_rand, input_ptr);
-        else
-            clear_bit(output_rand, input_ptr);
 
-        bit = get_bit(input_rom, get_bit_offset(input_ptr, sizeof(input_rom)*8));
-        if (bit)
-            set_bit(output_rom, input_ptr);
-        else
-            clear_bit(output_rom, input_ptr);
+    // Make the reference patterns to look for
+    ref_cache_pass++;
+    for (r = 0; r < rom_count; r++) {
+        patches[r].ref = reference_pattern(patches[r].bytes, roms[r].seed ? roms[r].seed : 1);
+        if (!patches[r].ref) {
+            free(arena);
+            fprintf(stderr, "unable to allocate reference pattern\n");
+            return -1;
+        }
     }
 
     while (1)
@@ -302,9 +749,17 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
                        (bs.current_width * bs.current_height) / 8);
                 bs.cram_width = MAX(bs.cram_width, bs.current_width);
                 bs.cram_height = MAX(bs.cram_height, bs.current_height);
-                for (i = 0; i < ((bs.current_width * bs.current_height) / 8); i++)
-                {
-                    irw_writeb(o, irw_readb(f));
+
+                // CRAM is never patched, so forward it a chunk at a time
+                uint8_t cram_chunk[1024];
+                uint32_t cram_left = (bs.current_width * bs.current_height) / 8;
+                while (cram_left) {
+                    size_t n = cram_left < sizeof(cram_chunk) ? cram_left : sizeof(cram_chunk);
+                    n = irw_read(f, cram_chunk, n);
+                    if (!n)
+                        break;
+                    irw_write(o, cram_chunk, n);
+                    cram_left -= n;
                 }
                 last0 = irw_readb(f);
                 last1 = irw_readb(f);
@@ -325,7 +780,6 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
                        (bs.current_width * bs.current_height) / 8);
                 bs.bram_width = MAX(bs.bram_width, bs.current_width);
                 bs.bram_height = MAX(bs.bram_height, bs.current_height);
-                ora_ptr = 16 * bs.current_offset;
 
                 // Step 1: Find a mapping by scanning through the first 128 words looking for patterns.
                 uint16_t scan_buffer[128];
@@ -340,66 +794,44 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
                     SCAN_DEBUG_PRINT(" %04x", scan_buffer[i]);
                 }
                 SCAN_DEBUG_PRINT("\n");
-
-                SCAN_DEBUG_PRINT("rand:");
-                for (i = 0; i < ARRAY_SIZE(scan_buffer); i++) {
-                    SCAN_DEBUG_PRINT(" %04x", ora16[ora_ptr + i]);
-                }
-                SCAN_DEBUG_PRINT("\n");
-
-                SCAN_DEBUG_PRINT(" rom:");
-                for (i = 0; i < ARRAY_SIZE(scan_buffer); i++) {
-                    SCAN_DEBUG_PRINT(" %04x", oro16[ora_ptr + i]);
-                }
-                SCAN_DEBUG_PRINT("\n");
 #endif /* SCAN_DEBUG */
 
-                int outer_word = 0;
-                static struct {
-                    int bitstream;
-                    int random;
-                    int stride;
-                } word_mappings[16];
+                // Step 2: Try every ROM's reference pattern, first where
+                // this block would be if its ROM started the bank, and
+                // then anywhere in the pattern.
+                struct word_mapping word_mappings[16];
                 int word_stride = -1;
-                for (outer_word = 0; outer_word < 16; outer_word++) {
-                    int inner_word;
-                    word_mappings[outer_word].bitstream = -1;
-                    word_mappings[outer_word].random = -1;
-                    word_mappings[outer_word].stride = -1;
-                    for (inner_word = 0; inner_word < 16; inner_word++) {
-                        // We have a candidate offset.  Figure out what its stride is,
-                        // and validate that we have multiple matches.
-                        if (scan_buffer[outer_word] == ora16[ora_ptr + inner_word]) {
-                            SCAN_DEBUG_PRINT("Candidate %04x @ %d/%d\n", scan_buffer[outer_word], outer_word, inner_word);
-                            int scan_offset = 0;
-                            for (scan_offset = 0; scan_offset < 30; scan_offset++) {
-                                if ((scan_buffer[outer_word + scan_offset] == ora16[ora_ptr + inner_word + 16])
-                                &&  (scan_buffer[outer_word + (scan_offset*2)] == ora16[ora_ptr + inner_word + 32])) {
-                                    SCAN_DEBUG_PRINT("Scan offset: %d\n", scan_offset);
-                                    word_mappings[outer_word].bitstream = outer_word;
-                                    word_mappings[outer_word].random = inner_word;
-                                    word_mappings[outer_word].stride = scan_offset;
-                                }
-                            }
-                        }
-                    }
-                }
-                for (i = 0; i < ARRAY_SIZE(word_mappings); i++) {
-                    if (word_mappings[i].stride != -1) {
-                        if (word_stride != -1) {
-                            if (word_mappings[i].stride != word_stride) {
-                                printf("This stride is different (%d vs expected %d)\n", word_mappings[i].stride, word_stride);
-                            }
-                        }
-                        word_stride = word_mappings[i].stride;
+                for (r = 0; (r < rom_count) && (word_stride == -1); r++) {
+                    const struct ref_pattern *ref = patches[r].ref;
+                    rom_words = patches[r].bytes / sizeof(uint16_t);
+                    ora_ptr = 16 * bs.current_offset;
+                    word_stride = find_mapping(scan_buffer, ref->words, rom_words, ora_ptr, word_mappings);
+                    if (word_stride == -1)
+                        word_stride = search_mapping(scan_buffer, ref, &ora_ptr, word_mappings);
+                    if (word_stride != -1) {
+                        ora16 = ref->words;
+                        oro16 = (const uint16_t *)(arena + patches[r].offset + patches[r].bytes);
+                        patches[r].blocks++;
+                        DEBUG_PRINT("BRAM block matches rom %d at word %d\n", r, ora_ptr);
+                        if (maps && record_map(maps, map_count, bs.current_bank, bs.current_offset,
+                                               r, ora_ptr, word_stride, word_mappings))
+                            errors = -1;
                     }
                 }
 
 #ifdef SCAN_DEBUG
-                for (outer_word = 0; outer_word < ARRAY_SIZE(word_mappings); outer_word++) {
-                    SCAN_DEBUG_PRINT("word_mappings[%2d]:  bitstream: %2d  random: %2d  stride: %2d\n",
-                    outer_word, word_mappings[outer_word].bitstream,
-                    word_mappings[outer_word].random, word_mappings[outer_word].stride);
+                if (word_stride != -1) {
+                    SCAN_DEBUG_PRINT("rand:");
+                    for (i = 0; i < ARRAY_SIZE(scan_buffer); i++) {
+                        SCAN_DEBUG_PRINT(" %04x", ora16[ora_ptr + i]);
+                    }
+                    SCAN_DEBUG_PRINT("\n");
+
+                    SCAN_DEBUG_PRINT(" rom:");
+                    for (i = 0; i < ARRAY_SIZE(scan_buffer); i++) {
+                        SCAN_DEBUG_PRINT(" %04x", oro16[ora_ptr + i]);
+                    }
+                    SCAN_DEBUG_PRINT("\n");
                 }
 #endif /* SCAN_DEBUG */
 
@@ -413,7 +845,7 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
                     uint16_t old_word = scan_buffer[i];
                     uint16_t check_word;
                     uint16_t new_word;
-                    if (mapping == -1) {
+                    if ((mapping == -1) || (ora_ptr + offset + mapping >= rom_words)) {
                         new_word = check_word = old_word;
                     }
                     else {
@@ -442,7 +874,7 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
                         ;
                     uint16_t check_word;
                     uint16_t new_word;
-                    if (mapping == -1) {
+                    if ((mapping == -1) || (ora_ptr + offset + mapping >= rom_words)) {
                         new_word = check_word = old_word;
                     }
                     else {
@@ -566,5 +998,105 @@ int ice40_patch(struct irw_file *f, struct irw_file *rom,
     // Padding
     irw_writeb(o, 0);
 
+    // A ROM that wasn't found means the bitstream went out unpatched
+    for (r = 0; r < rom_count; r++) {
+        if (!patches[r].blocks) {
+            fprintf(stderr, "rom %d: reference pattern (%d bytes, seed %u) not found in bitstream\n",
+                    r, patches[r].bytes, roms[r].seed ? roms[r].seed : 1);
+            errors = -1;
+        }
+    }
+
+    free(arena);
+    return errors;
+}
+
+int ice40_patch_direct(const struct bitstream *bs, struct ice40_rom *roms, int rom_count,
+                       const struct ice40_bram_map *maps, int map_count, struct irw_file *o)
+{
+    struct rom_patch patches[ICE40_MAX_ROMS];
+    uint8_t *arena;
+    uint8_t *out;
+    uint32_t crc_start = bs->preamble;
+    int errors = 0;
+    int m;
+    int i;
+
+    arena = load_roms(roms, rom_count, patches);
+    if (!arena)
+        return -1;
+    out = malloc(bs->length);
+    if (!out) {
+        fprintf(stderr, "unable to allocate memory for patched bitstream\n");
+        free(arena);
+        return -1;
+    }
+    memcpy(out, bs->data, bs->length);
+
+    for (m = 0; m < map_count; m++) {
+        const struct ice40_bram_map *map = &maps[m];
+        const struct bitstream_record *rec = NULL;
+        const uint16_t *oro16;
+        uint32_t rom_words;
+        uint32_t w;
+
+        for (i = 0; i < bs->count; i++) {
+            if ((bs->records[i].type == BR_BRAM) && (bs->records[i].bank == map->bank)
+             && (bs->records[i].offset == map->offset)) {
+                rec = &bs->records[i];
+                break;
+            }
+        }
+        if (!rec) {
+            fprintf(stderr, "bram map: no BRAM block in bank %u at offset 0x%x\n",
+                    map->bank, map->offset);
+            errors = -1;
+            break;
+        }
+        if ((map->rom < 0) || (map->rom >= rom_count)
+         || (map->stride < 1) || (map->stride > ICE40_BRAM_LANES)) {
+            fprintf(stderr, "bram map: invalid entry for bank %u offset 0x%x\n",
+                    map->bank, map->offset);
+            errors = -1;
+            break;
+        }
+
+        // Word w of the block is the same word of the sprayed ROM that
+        // the scan would have matched it against.
+        oro16 = (const uint16_t *)(arena + patches[map->rom].offset + patches[map->rom].bytes);
+        rom_words = patches[map->rom].bytes / sizeof(uint16_t);
+        for (w = 0; w < rec->length / 2; w++) {
+            int lane = map->lane[w % map->stride];
+            uint32_t word = map->base + (w / map->stride) * 16 + lane;
+            if ((lane < 0) || (word >= rom_words))
+                continue;
+            out[rec->data + w * 2] = oro16[word] >> 8;
+            out[rec->data + w * 2 + 1] = oro16[word];
+        }
+        patches[map->rom].blocks++;
+    }
+
+    // Every CRC covers the blocks patched since the last reset
+    for (i = 0; !errors && (i < bs->count); i++) {
+        const struct bitstream_record *rec = &bs->records[i];
+        if (rec->type == BR_CRC_RESET)
+            crc_start = rec->data;
+        else if (rec->type == BR_CRC_CHECK) {
+            uint16_t crc = ice40_crc16(0xffff, out + crc_start, rec->data - crc_start);
+            out[rec->data] = crc >> 8;
+            out[rec->data + 1] = crc;
+        }
+    }
+
+    for (m = 0; !errors && (m < rom_count); m++) {
+        if (!patches[m].blocks) {
+            fprintf(stderr, "rom %d: not in the bram map\n", m);
+            errors = -1;
+        }
+    }
+    if (!errors && irw_write(o, out, bs->length))
+        errors = -1;
+    free(out);
+    free(arena);
     return errors;
 }
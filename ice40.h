@@ -4,25 +4,94 @@
 #include <stdio.h>
 #include <stdint.h>
 
+// Files are read ahead, and written behind, this many bytes at a time
+#define IRW_BUFFER_SIZE 16384
+
 typedef struct irw_file
 {
     FILE *f;
     uint16_t crc;
     uint32_t offset;
     void *hook_data;
-    int (*read_hook)(void *data);
-    int (*write_hook)(void *data, uint8_t b);
+    int (*write_block_hook)(void *data, const uint8_t *b, size_t count);
+    int writing;
+    size_t buf_pos;
+    size_t buf_len;
+    uint8_t buf[IRW_BUFFER_SIZE];
 } IRW_FILE;
 
 struct irw_file *irw_open(const char *filename, const char *mode);
-struct irw_file *irw_open_fake(void *hook_data,
-                               int (*read_hook)(void *data),
-                               int (*write_hook)(void *data, uint8_t b));
+// A write-only stream that hands its data to `write_block_hook` in
+// buffer-sized chunks.  The hook returns non-zero on error.
+struct irw_file *irw_open_block(void *hook_data,
+                                int (*write_block_hook)(void *data, const uint8_t *b,
+                                                        size_t count));
 int irw_readb(struct irw_file *f);
 int irw_writeb(struct irw_file *f, int c);
+// Block versions of irw_readb() and irw_writeb().  irw_read() returns
+// the number of bytes read, which is short only at the end of the file.
+size_t irw_read(struct irw_file *f, uint8_t *data, size_t count);
+int irw_write(struct irw_file *f, const uint8_t *data, size_t count);
+int irw_flush(struct irw_file *f);
 void irw_close(struct irw_file **f);
 
-int ice40_patch(struct irw_file *f, struct irw_file *rom,
-                struct irw_file *o, uint32_t byte_count);
+// Update a CRC-16-CCITT (as used by iCE40 bitstreams) over a buffer
+uint16_t ice40_crc16(uint16_t crc, const void *data, size_t len);
+
+// ROMs are laid out in rows of 1 KiB, and must be a power of two in size
+#define ICE40_MIN_ROM_SIZE 1024
+#define ICE40_MAX_ROM_SIZE (1024 * 1024)
+
+// The smallest ROM size that will hold a `length` byte ROM image
+uint32_t ice40_rom_size(uint32_t length);
+
+// ROMs are this size unless told otherwise
+#define ICE40_DEFAULT_ROM_SIZE 8192
+
+// Use the ROM file's length, rounded up with ice40_rom_size()
+#define ICE40_ROM_SIZE_AUTO 0xffffffff
+
+// Up to this many ROMs can be patched into one bitstream
+#define ICE40_MAX_ROMS 8
+
+struct ice40_rom {
+    struct irw_file *file;
+    uint32_t size;      // Size of the ROM in the bitstream, or 0 for the default
+    uint32_t seed;      // xorshift seed of its reference pattern, or 0 for 1
+};
+
+// Copy bitstream `f` to `o` in one pass, replacing each BRAM block that
+// holds part of a ROM's reference pattern with that part of the ROM.
+// A ROM with no size is taken to be ICE40_DEFAULT_ROM_SIZE.
+int ice40_patch(struct irw_file *f, struct ice40_rom *roms, int rom_count,
+                struct irw_file *o);
+
+// A BRAM block is patched 16-bit word by word.  Word w of the block in
+// `bank` at `offset` gets word base + (w / stride) * 16 + lane[w % stride]
+// of ROM `rom` as sprayed into the FPGA, or is left alone if its lane
+// is -1 or the word is past the end of the ROM.
+#define ICE40_BRAM_LANES 16
+
+struct ice40_bram_map {
+    uint32_t bank;
+    uint32_t offset;
+    int rom;
+    uint32_t base;
+    int stride;
+    int lane[ICE40_BRAM_LANES];
+};
+
+// ice40_patch(), also returning where every block of every ROM was
+// found in a newly allocated `maps` array, to be freed by the caller.
+int ice40_patch_record(struct irw_file *f, struct ice40_rom *roms, int rom_count,
+                       struct irw_file *o, struct ice40_bram_map **maps, int *map_count);
+
+struct bitstream;
+
+// Patch the blocks listed in `maps` straight from the ROMs, without
+// looking for reference patterns, and write the bitstream to `o` with
+// its CRCs recomputed.
+int ice40_patch_direct(const struct bitstream *bs, struct ice40_rom *roms, int rom_count,
+                       const struct ice40_bram_map *maps, int map_count, struct irw_file *o);
 
 #endif /* _ICE40_H */
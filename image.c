@@ -0,0 +1,505 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "spi.h"
+#include "digest.h"
+#include "memscan.h"
+#include "verify.h"
+#include "image.h"
+
+#define LZ4_MAGIC           0x184d2204
+#define LZ4_SKIPPABLE_MAGIC 0x184d2a50 // Low nybble is user-defined
+#define LZ4_WINDOW_SIZE     65536
+#define ZSTD_MAGIC          0xfd2fb528
+
+#define IMAGE_PAGE_SIZE 256
+
+// How much flash to read back between compares when verifying
+#define IMAGE_VERIFY_CHUNK_SIZE 65536
+
+enum image_format {
+    IF_RAW,
+    IF_LZ4,
+    IF_ZSTD,
+};
+
+struct image {
+    FILE *f;
+    enum image_format format;
+    int eof;
+
+    // Decoded bytes waiting to be read are out[out_pos..out_len)
+    uint8_t *out;
+    size_t out_pos;
+    size_t out_len;
+
+    // LZ4 frame state.  Blocks may refer back into the previous 64 KB
+    // of output, so that much history is kept at the start of `out`.
+    int lz4_in_frame;
+    int lz4_block_checksum;
+    int lz4_content_checksum;
+    struct xxh32_ctx lz4_content_xxh;
+    size_t lz4_block_max;
+    uint8_t *lz4_in;
+
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+    ZSTD_inBuffer zstd_in;
+    uint8_t *zstd_in_buf;
+    size_t zstd_in_size;
+    size_t zstd_pending;    // Non-zero while a frame is incomplete
+#endif
+};
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int image_read_exact(struct image *img, void *buf, size_t len) {
+    return fread(buf, 1, len, img->f) == len ? 0 : -1;
+}
+
+// Decode one LZ4 block from `in` into `out` starting at `pos`, where
+// everything before `pos` is history.  Returns the new end of output.
+static ssize_t lz4_decode_block(const uint8_t *in, size_t in_len,
+                                uint8_t *out, size_t pos, size_t out_cap) {
+    const uint8_t *ip = in;
+    const uint8_t *iend = in + in_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (((size_t)(iend - ip) < len) || (out_cap - pos < len))
+            return -1;
+        memcpy(out + pos, ip, len);
+        ip += len;
+        pos += len;
+
+        // The last sequence has only literals
+        if (ip >= iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || (offset > pos))
+            return -1;
+
+        len = token & 0xf;
+        if (len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += 4;
+        if (out_cap - pos < len)
+            return -1;
+
+        // Matches may overlap their own output, so copy forwards
+        const uint8_t *match = out + pos - offset;
+        while (len--)
+            out[pos++] = *match++;
+    }
+    return pos;
+}
+
+// Parse an LZ4 frame header, whose magic has already been consumed.
+static int lz4_frame_begin(struct image *img) {
+    uint8_t desc[2 + 8 + 1];
+    size_t desc_len;
+    static const size_t block_sizes[] = { 65536, 262144, 1048576, 4194304 };
+
+    if (image_read_exact(img, desc, 2))
+        return -1;
+    if ((desc[0] >> 6) != 1) {
+        fprintf(stderr, "lz4: unsupported frame version\n");
+        return -1;
+    }
+    if (desc[0] & 1) {
+        fprintf(stderr, "lz4: dictionaries are not supported\n");
+        return -1;
+    }
+    if (((desc[1] >> 4) & 7) < 4) {
+        fprintf(stderr, "lz4: bad block size\n");
+        return -1;
+    }
+    img->lz4_block_checksum = !!(desc[0] & (1 << 4));
+    img->lz4_content_checksum = !!(desc[0] & (1 << 2));
+
+    // Read the optional content size, then the header checksum, which
+    // is the second byte of the hash of everything before it
+    desc_len = (desc[0] & (1 << 3)) ? 10 : 2;
+    if (image_read_exact(img, desc + 2, desc_len - 2 + 1))
+        return -1;
+    if (desc[desc_len] != ((digestXxh32(desc, desc_len, 0) >> 8) & 0xff)) {
+        fprintf(stderr, "lz4: bad frame header checksum\n");
+        return -1;
+    }
+    digestXxh32Init(&img->lz4_content_xxh, 0);
+
+    size_t block_max = block_sizes[((desc[1] >> 4) & 7) - 4];
+    if (block_max > img->lz4_block_max) {
+        uint8_t *out = realloc(img->out, LZ4_WINDOW_SIZE + block_max);
+        uint8_t *in = realloc(img->lz4_in, block_max);
+        if (!out || !in) {
+            free(out ? out : img->out);
+            free(in ? in : img->lz4_in);
+            img->out = NULL;
+            img->lz4_in = NULL;
+            return -1;
+        }
+        img->out = out;
+        img->lz4_in = in;
+        img->lz4_block_max = block_max;
+    }
+    img->lz4_in_frame = 1;
+    return 0;
+}
+
+// Decode the next LZ4 block.  Returns 0 on success, 1 at end of input.
+static int lz4_next_block(struct image *img) {
+    uint8_t word[4];
+
+    while (!img->lz4_in_frame) {
+        uint32_t magic;
+        if (fread(word, 1, sizeof(word), img->f) != sizeof(word))
+            return 1;
+        magic = get32(word);
+        if (magic == LZ4_MAGIC) {
+            if (lz4_frame_begin(img))
+                return -1;
+        }
+        else if ((magic & 0xfffffff0) == LZ4_SKIPPABLE_MAGIC) {
+            if (image_read_exact(img, word, sizeof(word))
+             || fseek(img->f, get32(word), SEEK_CUR))
+                return -1;
+        }
+        else {
+            fprintf(stderr, "lz4: bad frame magic %08x\n", magic);
+            return -1;
+        }
+    }
+
+    if (image_read_exact(img, word, sizeof(word)))
+        return -1;
+    uint32_t size = get32(word);
+    if (!size) {
+        // End mark, possibly followed by a content checksum
+        if (img->lz4_content_checksum) {
+            if (image_read_exact(img, word, sizeof(word)))
+                return -1;
+            if (get32(word) != digestXxh32Final(&img->lz4_content_xxh)) {
+                fprintf(stderr, "lz4: bad content checksum\n");
+                return -1;
+            }
+        }
+        img->lz4_in_frame = 0;
+        return lz4_next_block(img);
+    }
+
+    int uncompressed = !!(size & 0x80000000);
+    size &= 0x7fffffff;
+    if ((size > img->lz4_block_max) || image_read_exact(img, img->lz4_in, size))
+        return -1;
+    if (img->lz4_block_checksum) {
+        if (image_read_exact(img, word, sizeof(word)))
+            return -1;
+        if (get32(word) != digestXxh32(img->lz4_in, size, 0)) {
+            fprintf(stderr, "lz4: bad block checksum\n");
+            return -1;
+        }
+    }
+
+    // Keep the last 64 KB of output as history for the next block
+    size_t history = img->out_len < LZ4_WINDOW_SIZE ? img->out_len : LZ4_WINDOW_SIZE;
+    memmove(img->out, img->out + img->out_len - history, history);
+    img->out_pos = img->out_len = history;
+
+    if (uncompressed) {
+        memcpy(img->out + history, img->lz4_in, size);
+        img->out_len = history + size;
+    }
+    else {
+        ssize_t end = lz4_decode_block(img->lz4_in, size, img->out, history,
+                                       LZ4_WINDOW_SIZE + img->lz4_block_max);
+        if (end < 0) {
+            fprintf(stderr, "lz4: corrupt block\n");
+            return -1;
+        }
+        img->out_len = end;
+    }
+    if (img->lz4_content_checksum)
+        digestXxh32Update(&img->lz4_content_xxh, img->out + history, img->out_len - history);
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_next_block(struct image *img) {
+    ZSTD_outBuffer output = { img->out, ZSTD_DStreamOutSize(), 0 };
+
+    while (!output.pos) {
+        if (img->zstd_in.pos >= img->zstd_in.size) {
+            img->zstd_in.size = fread(img->zstd_in_buf, 1, img->zstd_in_size, img->f);
+            img->zstd_in.pos = 0;
+            if (!img->zstd_in.size && !img->zstd_pending)
+                return 1;
+        }
+
+        // With no input left, this only flushes already-decoded data
+        size_t ret = ZSTD_decompressStream(img->zstd, &output, &img->zstd_in);
+        if (ZSTD_isError(ret)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (!img->zstd_in.size && !output.pos) {
+            fprintf(stderr, "zstd: truncated frame\n");
+            return -1;
+        }
+        img->zstd_pending = ret;
+    }
+    img->out_pos = 0;
+    img->out_len = output.pos;
+    return 0;
+}
+#endif
+
+static int image_refill(struct image *img) {
+    switch (img->format) {
+    case IF_LZ4:
+        return lz4_next_block(img);
+#ifdef HAVE_ZSTD
+    case IF_ZSTD:
+        return zstd_next_block(img);
+#endif
+    default:
+        return 1;
+    }
+}
+
+struct image *imageOpen(const char *path) {
+    struct image *img;
+    uint8_t magic[4];
+    size_t got;
+
+    img = malloc(sizeof(*img));
+    if (!img)
+        return NULL;
+    memset(img, 0, sizeof(*img));
+    img->f = fopen(path, "rb");
+    if (!img->f) {
+        free(img);
+        return NULL;
+    }
+
+    got = fread(magic, 1, sizeof(magic), img->f);
+    if ((got == sizeof(magic)) && (get32(magic) == LZ4_MAGIC)) {
+        img->format = IF_LZ4;
+        if (!lz4_frame_begin(img))
+            return img;
+    }
+    else if ((got == sizeof(magic)) && (get32(magic) == ZSTD_MAGIC)) {
+#ifdef HAVE_ZSTD
+        img->format = IF_ZSTD;
+        img->zstd = ZSTD_createDStream();
+        img->zstd_in_size = ZSTD_DStreamInSize();
+        img->zstd_in_buf = malloc(img->zstd_in_size);
+        img->out = malloc(ZSTD_DStreamOutSize());
+        if (img->zstd && img->zstd_in_buf && img->out) {
+            ZSTD_initDStream(img->zstd);
+            memcpy(img->zstd_in_buf, magic, sizeof(magic));
+            img->zstd_in.src = img->zstd_in_buf;
+            img->zstd_in.size = sizeof(magic);
+            img->zstd_in.pos = 0;
+            return img;
+        }
+#else
+        fprintf(stderr, "%s: zstd support was not built in (rebuild with ZSTD=1)\n", path);
+#endif
+    }
+    else {
+        img->format = IF_RAW;
+        rewind(img->f);
+        return img;
+    }
+
+    imageClose(&img);
+    errno = EINVAL;
+    return NULL;
+}
+
+void imageClose(struct image **img) {
+    if (!img || !*img)
+        return;
+    fclose((*img)->f);
+#ifdef HAVE_ZSTD
+    if ((*img)->zstd)
+        ZSTD_freeDStream((*img)->zstd);
+    free((*img)->zstd_in_buf);
+#endif
+    free((*img)->lz4_in);
+    free((*img)->out);
+    free(*img);
+    *img = NULL;
+}
+
+ssize_t imageRead(struct image *img, uint8_t *buf, size_t len) {
+    size_t done = 0;
+
+    if (img->format == IF_RAW) {
+        done = fread(buf, 1, len, img->f);
+        return ferror(img->f) ? -1 : (ssize_t)done;
+    }
+
+    while ((done < len) && !img->eof) {
+        if (img->out_pos >= img->out_len) {
+            int ret = image_refill(img);
+            if (ret < 0)
+                return -1;
+            if (ret > 0) {
+                img->eof = 1;
+                break;
+            }
+            continue;
+        }
+        size_t n = img->out_len - img->out_pos;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, img->out + img->out_pos, n);
+        img->out_pos += n;
+        done += n;
+    }
+    return done;
+}
+
+uint8_t *imageReadAll(struct image *img, uint32_t *length) {
+    size_t cap = 65536;
+    size_t len = 0;
+    uint8_t *data = malloc(cap);
+    ssize_t got;
+
+    while (data) {
+        if (len == cap) {
+            uint8_t *bigger = realloc(data, cap * 2);
+            if (!bigger)
+                break;
+            data = bigger;
+            cap *= 2;
+        }
+        got = imageRead(img, data + len, cap - len);
+        if (got < 0)
+            break;
+        len += got;
+        if (len < cap) {
+            *length = len;
+            return data;
+        }
+    }
+    free(data);
+    return NULL;
+}
+
+int imageWrite(struct ff_spi *spi, uint32_t addr, struct image *img, int quiet) {
+    uint32_t sector_size = spiEraseSize(spi);
+    uint8_t *bfr = malloc(sector_size);
+    uint32_t offset = 0;
+    uint32_t skipped = 0;
+    ssize_t len;
+    int ret = 0;
+
+    if (!bfr)
+        return 1;
+
+    // Each sector is erased and then programmed as soon as it has been
+    // decoded, so only one sector of the image is ever in memory.  The
+    // first chunk only runs up to the end of its sector, so no erase
+    // ever reaches back into a sector that has already been programmed.
+    while (!ret && ((len = imageRead(img, bfr, sector_size - (addr + offset) % sector_size)) > 0)) {
+        uint32_t page = 0;
+        uint32_t lead = (addr + offset) % sector_size;
+
+        ret = spiErase(spi, addr + offset - lead, lead + len, 1);
+        while (!ret && (page < (uint32_t)len)) {
+            uint32_t run;
+            uint32_t page_len = len - page < IMAGE_PAGE_SIZE ? len - page : IMAGE_PAGE_SIZE;
+
+            // Erased pages are already 0xff, so don't program them
+            if (memscanErased(bfr + page, page_len) == page_len) {
+                page += page_len;
+                skipped++;
+                continue;
+            }
+            for (run = page; run < (uint32_t)len; run += IMAGE_PAGE_SIZE) {
+                uint32_t run_len = len - run < IMAGE_PAGE_SIZE ? len - run : IMAGE_PAGE_SIZE;
+                if (memscanErased(bfr + run, run_len) == run_len)
+                    break;
+            }
+            ret = spiProgram(spi, addr + offset + page, bfr + page, run - page, 1);
+            page = run;
+        }
+        offset += len;
+        if (!quiet) {
+            printf("\rWriting @ %06x", addr + offset);
+            fflush(stdout);
+        }
+        if ((uint32_t)len < sector_size - lead)
+            break;
+    }
+    if (len < 0) {
+        fprintf(stderr, "unable to read image\n");
+        ret = 1;
+    }
+    if (!quiet && !ret)
+        printf("  Done (%u erased page(s) skipped)\n", skipped);
+    free(bfr);
+    return ret;
+}
+
+int imageVerify(struct ff_spi *spi, uint32_t addr, struct image *img,
+                struct verify_report *report, int fail_fast) {
+    uint8_t *expected = malloc(IMAGE_VERIFY_CHUNK_SIZE);
+    uint8_t *actual = malloc(IMAGE_VERIFY_CHUNK_SIZE);
+    uint32_t offset = 0;
+    ssize_t len;
+    int ret = 0;
+
+    if (!expected || !actual) {
+        free(expected);
+        free(actual);
+        return 1;
+    }
+    while ((len = imageRead(img, expected, IMAGE_VERIFY_CHUNK_SIZE)) > 0) {
+        spiRead(spi, addr + offset, actual, len);
+        if (verifyChunk(report, addr + offset, expected, actual, len) && fail_fast)
+            break;
+        offset += len;
+    }
+    if (len < 0) {
+        fprintf(stderr, "unable to read image\n");
+        ret = 1;
+    }
+    free(expected);
+    free(actual);
+    return ret;
+}
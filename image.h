@@ -0,0 +1,31 @@
+#ifndef FF_IMAGE_H_
+#define FF_IMAGE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ff_spi;
+struct verify_report;
+struct image;
+
+// Open an image for streaming.  LZ4 frames are decoded in-tree, zstd
+// frames when built with ZSTD=1, and anything else is read as-is.
+struct image *imageOpen(const char *path);
+void imageClose(struct image **img);
+
+// Read up to `len` decoded bytes, returning fewer only at the end of
+// the image, or -1 on error.
+ssize_t imageRead(struct image *img, uint8_t *buf, size_t len);
+
+// Decode the whole image into a newly-allocated buffer.
+uint8_t *imageReadAll(struct image *img, uint32_t *length);
+
+// Erase and program the image a sector at a time as it is decoded,
+// skipping pages that are entirely 0xff.  Returns 0 on success.
+int imageWrite(struct ff_spi *spi, uint32_t addr, struct image *img, int quiet);
+
+// Compare the flash against the image as it is decoded.
+int imageVerify(struct ff_spi *spi, uint32_t addr, struct image *img,
+                struct verify_report *report, int fail_fast);
+
+#endif /* FF_IMAGE_H_ */
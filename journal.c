@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "spi.h"
+#include "digest.h"
+#include "memscan.h"
+#include "journal.h"
+
+#define JOURNAL_PAGE_SIZE 256
+
+struct journal {
+    FILE *f;
+    uint32_t sector_size;
+    uint32_t end;
+};
+
+static void journal_sync(struct journal *j) {
+    fflush(j->f);
+    fdatasync(fileno(j->f));
+}
+
+// Erase records are synced right away since erases are slow anyway.
+// Page records are synced once per sector, and anything that was lost
+// is rediscovered when the in-flight sector is checked on resume.
+static void journal_progress(void *data, enum spi_progress what, uint32_t addr) {
+    struct journal *j = data;
+
+    switch (what) {
+    case SPI_PROGRESS_ERASED:
+        fprintf(j->f, "E %08x\n", addr);
+        journal_sync(j);
+        break;
+    case SPI_PROGRESS_PROGRAMMED:
+        fprintf(j->f, "P %08x\n", addr);
+        if (!(addr % j->sector_size) || (addr == j->end))
+            journal_sync(j);
+        break;
+    }
+}
+
+static void journal_header(char *out, size_t len, uint32_t addr,
+                           const uint8_t *data, uint32_t count) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+    digestSha256(data, count, digest);
+    digestToHex(digest, sizeof(digest), hex);
+    snprintf(out, len, "fomu-flash-journal 1 addr %08x length %u sha256 %s\n", addr, count, hex);
+}
+
+// Read back the journal of a previous run.  Returns 0 if it belongs to
+// this image, and fills in how far erasing and programming got.
+static int journal_replay(const char *path, const char *header,
+                          uint32_t *erased_end, uint32_t *programmed_end,
+                          uint32_t sector_size) {
+    char line[256];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f) || strcmp(line, header)) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        uint32_t a;
+        char type;
+        if (sscanf(line, "%c %x", &type, &a) != 2)
+            break;
+        if ((type == 'E') && (a + sector_size > *erased_end))
+            *erased_end = a + sector_size;
+        else if ((type == 'P') && (a > *programmed_end))
+            *programmed_end = a;
+    }
+    fclose(f);
+    return 0;
+}
+
+// The sector that was being programmed when the last run stopped may
+// have pages beyond what the journal recorded.  Accept it only if it
+// is the image up to some page and erased after that; otherwise erase
+// it again.  Returns where programming should continue.
+static uint32_t journal_check_sector(struct ff_spi *spi, uint32_t addr, const uint8_t *data,
+                                     uint32_t count, uint32_t programmed_end,
+                                     uint32_t sector_size, int quiet) {
+    uint32_t sector = programmed_end - ((programmed_end - addr) % sector_size);
+    uint32_t sector_end = sector + sector_size;
+    uint8_t page[JOURNAL_PAGE_SIZE];
+    uint32_t p;
+    int bad = 0;
+
+    if (sector_end > addr + count)
+        sector_end = addr + count;
+
+    for (p = sector; p < sector_end; p += sizeof(page)) {
+        uint32_t len = sector_end - p;
+        if (len > sizeof(page))
+            len = sizeof(page);
+        spiRead(spi, p, page, len);
+        if (memscanDiff(page, data + (p - addr), len) != len)
+            break;
+    }
+    if (p < programmed_end)
+        bad = 1;
+    programmed_end = p;
+    for (; !bad && (p < sector_end); p += sizeof(page)) {
+        uint32_t len = sector_end - p;
+        if (len > sizeof(page))
+            len = sizeof(page);
+        spiRead(spi, p, page, len);
+        if (memscanErased(page, len) != len)
+            bad = 1;
+    }
+
+    if (!bad)
+        return programmed_end;
+    if (!quiet)
+        printf("journal: sector 0x%08x was interrupted, erasing it again\n", sector);
+    if (spiErase(spi, sector, sector_end - sector, quiet))
+        return (uint32_t)-1;
+    return sector;
+}
+
+int journalWrite(struct ff_spi *spi, const char *path, int resume,
+                 uint32_t addr, const uint8_t *data, uint32_t count, int quiet) {
+    struct journal j;
+    char header[256];
+    uint32_t erased_end = addr;
+    uint32_t programmed_end = addr;
+    int resuming = 0;
+    int ret;
+
+    j.sector_size = spiEraseSize(spi);
+    j.end = addr + count;
+    journal_header(header, sizeof(header), addr, data, count);
+
+    if (resume && !journal_replay(path, header, &erased_end, &programmed_end, j.sector_size)) {
+        resuming = 1;
+        if (!quiet && (erased_end < j.end))
+            printf("journal: resuming erase @ %06x\n", erased_end);
+        else if (!quiet)
+            printf("journal: resuming program @ %06x\n", programmed_end);
+    }
+    else if (resume && !quiet)
+        printf("journal: no journal for this image in %s, starting over\n", path);
+
+    j.f = fopen(path, resuming ? "a" : "w");
+    if (!j.f) {
+        perror("unable to open journal");
+        return 1;
+    }
+    if (!resuming) {
+        fputs(header, j.f);
+        journal_sync(&j);
+    }
+    spiSetProgressHook(spi, journal_progress, &j);
+
+    if (erased_end < j.end) {
+        // Programming only starts once every block is erased, so
+        // nothing has been programmed yet.  The last recorded erase
+        // may not have finished, but erasing it again is harmless.
+        ret = spiErase(spi, erased_end, j.end - erased_end, quiet);
+        programmed_end = addr;
+    }
+    else {
+        ret = 0;
+        if (resuming && (programmed_end < j.end)) {
+            programmed_end = journal_check_sector(spi, addr, data, count, programmed_end,
+                                                  j.sector_size, quiet);
+            if (programmed_end == (uint32_t)-1)
+                ret = 1;
+        }
+    }
+
+    if (!ret && (programmed_end < j.end))
+        ret = spiProgram(spi, programmed_end, data + (programmed_end - addr),
+                         j.end - programmed_end, quiet);
+
+    spiSetProgressHook(spi, NULL, NULL);
+    fclose(j.f);
+    if (!ret)
+        unlink(path);
+    return ret;
+}
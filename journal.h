@@ -0,0 +1,16 @@
+#ifndef FF_JOURNAL_H_
+#define FF_JOURNAL_H_
+
+#include <stdint.h>
+
+struct ff_spi;
+
+// Write `data` to `addr`, recording each erased block and programmed
+// page in the journal at `path`.  If `resume` is set and the journal
+// describes the same image, pick up where the previous run stopped
+// after re-checking the sector that was in flight.  The journal is
+// removed once the write completes.  Returns 0 on success.
+int journalWrite(struct ff_spi *spi, const char *path, int resume,
+                 uint32_t addr, const uint8_t *data, uint32_t count, int quiet);
+
+#endif /* FF_JOURNAL_H_ */
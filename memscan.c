@@ -0,0 +1,68 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "memscan.h"
+
+static size_t memscan_diff_scalar(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        if (a[i] != b[i])
+            break;
+    return i;
+}
+
+size_t memscanDiff(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        uint64x2_t eq64 = vreinterpretq_u64_u8(eq);
+        if ((vgetq_lane_u64(eq64, 0) & vgetq_lane_u64(eq64, 1)) != ~0ULL)
+            break;
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    // Either no SIMD is available, or we're finishing up the tail / the
+    // block that contained the mismatch.
+    return i + memscan_diff_scalar(a + i, b + i, len - i);
+}
+
+size_t memscanErased(const uint8_t *buf, size_t len) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(buf + i));
+        if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != ~0ULL)
+            break;
+    }
+#elif defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ones));
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    for (; i < len; i++)
+        if (buf[i] != 0xff)
+            break;
+    return i;
+}
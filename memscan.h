@@ -0,0 +1,15 @@
+#ifndef FF_MEMSCAN_H_
+#define FF_MEMSCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Return the offset of the first byte where `a` and `b` differ, or
+// `len` if they are identical.  Uses NEON or SSE2 when available.
+size_t memscanDiff(const uint8_t *a, const uint8_t *b, size_t len);
+
+// Return the offset of the first byte that is not 0xff (i.e. not
+// erased), or `len` if the whole buffer is erased.
+size_t memscanErased(const uint8_t *buf, size_t len);
+
+#endif /* FF_MEMSCAN_H_ */
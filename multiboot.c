@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spi.h"
+#include "multiboot.h"
+
+static const uint8_t multiboot_preamble[4] = { 0x7e, 0xaa, 0x99, 0x7e };
+
+// Each entry is a tiny bitstream of its own: the preamble, the boot
+// mode, the image address, the bank offset and finally a reboot command.
+static void multiboot_encode_entry(uint8_t *e, uint32_t addr, int coldboot) {
+    memset(e, 0, MULTIBOOT_ENTRY_SIZE);
+    memcpy(e, multiboot_preamble, sizeof(multiboot_preamble));
+    e[4] = 0x92;
+    e[5] = 0x00;
+    e[6] = coldboot ? 0x10 : 0x00;
+    e[7] = 0x44;
+    e[8] = 0x03;
+    e[9] = addr >> 16;
+    e[10] = addr >> 8;
+    e[11] = addr;
+    e[12] = 0x82;
+    e[13] = 0x00;
+    e[14] = 0x00;
+    e[15] = 0x01;
+    e[16] = 0x08;
+}
+
+static int multiboot_decode_entry(const uint8_t *e, uint32_t *addr, int *coldboot) {
+    if (memcmp(e, multiboot_preamble, sizeof(multiboot_preamble))
+     || (e[4] != 0x92) || (e[7] != 0x44) || (e[8] != 0x03)
+     || (e[15] != 0x01) || (e[16] != 0x08))
+        return -1;
+    *addr = (e[9] << 16) | (e[10] << 8) | e[11];
+    *coldboot = !!(e[6] & 0x10);
+    return 0;
+}
+
+int multibootRead(struct ff_spi *spi, struct multiboot *mb) {
+    uint8_t header[MULTIBOOT_HEADER_SIZE];
+    int coldboot;
+    int i;
+
+    spiRead(spi, MULTIBOOT_HEADER_ADDR, header, sizeof(header));
+    if (multiboot_decode_entry(header, &mb->poweron, &mb->coldboot))
+        return -1;
+    for (i = 0; i < MULTIBOOT_SLOTS; i++)
+        if (multiboot_decode_entry(header + (i + 1) * MULTIBOOT_ENTRY_SIZE,
+                                   &mb->slot[i], &coldboot))
+            return -1;
+    return 0;
+}
+
+int multibootWrite(struct ff_spi *spi, const struct multiboot *mb, int quiet) {
+    uint32_t sector_size = spiEraseSize(spi);
+    uint32_t base = MULTIBOOT_HEADER_ADDR & ~(sector_size - 1);
+    uint32_t offset = MULTIBOOT_HEADER_ADDR - base;
+    uint8_t header[MULTIBOOT_HEADER_SIZE];
+    uint8_t *bfr;
+    int ret = 0;
+    int i;
+
+    multiboot_encode_entry(header, mb->poweron, mb->coldboot);
+    for (i = 0; i < MULTIBOOT_SLOTS; i++)
+        multiboot_encode_entry(header + (i + 1) * MULTIBOOT_ENTRY_SIZE,
+                               mb->slot[i], mb->coldboot);
+
+    // The header usually shares its sector with the start of an image,
+    // so read the whole sector and only replace the header bytes.
+    bfr = malloc(sector_size);
+    if (!bfr) {
+        perror("unable to allocate memory for multiboot header");
+        return 1;
+    }
+    spiRead(spi, base, bfr, sector_size);
+    if (!memcmp(bfr + offset, header, sizeof(header))) {
+        if (!quiet)
+            printf("multiboot header is already up to date\n");
+        free(bfr);
+        return 0;
+    }
+    memcpy(bfr + offset, header, sizeof(header));
+    ret = spiWrite(spi, base, bfr, sector_size, quiet);
+    free(bfr);
+    return ret;
+}
+
+int multibootParse(struct multiboot *mb, const char *spec) {
+    const char *p = spec;
+    char *end;
+    int count = 0;
+
+    memset(mb, 0, sizeof(*mb));
+    while (*p) {
+        if (count >= MULTIBOOT_SLOTS) {
+            fprintf(stderr, "multiboot: at most %d slots are supported\n", MULTIBOOT_SLOTS);
+            return -1;
+        }
+        mb->slot[count] = strtoul(p, &end, 0);
+        if ((end == p) || ((*end != ',') && *end)) {
+            fprintf(stderr, "multiboot: invalid slot address \"%s\"\n", p);
+            return -1;
+        }
+        if (mb->slot[count] > 0xffffff) {
+            fprintf(stderr, "multiboot: slot address 0x%x is beyond 16 MiB\n", mb->slot[count]);
+            return -1;
+        }
+        count++;
+        p = *end ? end + 1 : end;
+    }
+    if (!count) {
+        fprintf(stderr, "multiboot: no slot addresses given\n");
+        return -1;
+    }
+    for (; count < MULTIBOOT_SLOTS; count++)
+        mb->slot[count] = mb->slot[count - 1];
+    mb->poweron = mb->slot[0];
+    return 0;
+}
+
+void multibootPrint(FILE *stream, const struct multiboot *mb) {
+    int i;
+    fprintf(stream, "power-on: 0x%06x%s\n", mb->poweron,
+            mb->coldboot ? " (coldboot: CBSEL pins select the image)" : "");
+    for (i = 0; i < MULTIBOOT_SLOTS; i++)
+        fprintf(stream, "slot %d:   0x%06x\n", i, mb->slot[i]);
+}
+
+uint32_t multibootSlotSize(const struct multiboot *mb, int slot, int64_t flash_bytes) {
+    uint32_t start = mb->slot[slot];
+    int64_t end = flash_bytes;
+    int i;
+
+    if (start < MULTIBOOT_HEADER_ADDR + MULTIBOOT_HEADER_SIZE)
+        return 0;
+
+    // A slot ends where the next image starts.  Slots that share an
+    // address are the same image, so they don't limit each other.
+    for (i = 0; i < MULTIBOOT_SLOTS; i++)
+        if ((mb->slot[i] > start) && ((end == -1) || (mb->slot[i] < end)))
+            end = mb->slot[i];
+    if ((mb->poweron > start) && ((end == -1) || (mb->poweron < end)))
+        end = mb->poweron;
+    if (end == -1)
+        end = 0x1000000;
+    return end - start;
+}
+
+int multibootWriteSlot(struct ff_spi *spi, const struct multiboot *mb, int slot,
+                       const uint8_t *data, uint32_t count, int quiet) {
+    uint32_t sector_size = spiEraseSize(spi);
+    uint32_t addr = mb->slot[slot];
+    uint32_t slot_end = addr + multibootSlotSize(mb, slot, -1);
+    uint32_t start = addr & ~(sector_size - 1);
+    uint32_t end = (addr + count + sector_size - 1) & ~(sector_size - 1);
+    uint8_t *bfr;
+    int ret;
+
+    if (addr + count > slot_end) {
+        fprintf(stderr, "multiboot: %u byte image doesn't fit in slot %d (%u bytes)\n",
+                count, slot, slot_end - addr);
+        return 1;
+    }
+
+    bfr = malloc(end - start);
+    if (!bfr) {
+        perror("unable to allocate memory for multiboot slot");
+        return 1;
+    }
+
+    // Keep whatever shares the first and last sectors with this slot,
+    // and pad the rest of the last sector out with erased bytes.
+    if (addr > start)
+        spiRead(spi, start, bfr, addr - start);
+    memcpy(bfr + (addr - start), data, count);
+    memset(bfr + (addr - start) + count, 0xff, end - addr - count);
+    if (slot_end < end)
+        spiRead(spi, slot_end, bfr + (slot_end - start), end - slot_end);
+
+    ret = spiWrite(spi, start, bfr, end - start, quiet);
+    free(bfr);
+    return ret;
+}
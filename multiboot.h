@@ -0,0 +1,50 @@
+#ifndef FF_MULTIBOOT_H_
+#define FF_MULTIBOOT_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The iCE40 looks for a multiboot (warmboot) header at the start of
+// the flash.  It holds one entry for the power-on image, followed by
+// the four images that SB_WARMBOOT can select.
+#define MULTIBOOT_HEADER_ADDR 0
+#define MULTIBOOT_ENTRY_SIZE 32
+#define MULTIBOOT_ENTRIES 5
+#define MULTIBOOT_SLOTS (MULTIBOOT_ENTRIES - 1)
+#define MULTIBOOT_HEADER_SIZE (MULTIBOOT_ENTRIES * MULTIBOOT_ENTRY_SIZE)
+
+struct ff_spi;
+
+struct multiboot {
+    uint32_t poweron;                   // Image loaded after reset
+    uint32_t slot[MULTIBOOT_SLOTS];     // Images selected by warmboot
+    int coldboot;                       // Use CBSEL pins at power-on
+};
+
+// Read and decode the header from the flash.  Returns 0 on success, or
+// -1 if the flash doesn't start with a multiboot header.
+int multibootRead(struct ff_spi *spi, struct multiboot *mb);
+
+// Write the header, preserving the rest of the sector it lives in.
+// Returns 0 on success.
+int multibootWrite(struct ff_spi *spi, const struct multiboot *mb, int quiet);
+
+// Parse "addr0,addr1[,addr2,addr3]" into `mb`.  Slots that aren't given
+// repeat the last one, and the power-on image is slot 0.
+int multibootParse(struct multiboot *mb, const char *spec);
+
+void multibootPrint(FILE *stream, const struct multiboot *mb);
+
+// Work out how many bytes slot `slot` can hold before it runs into the
+// next image, the header, or the end of a `flash_bytes` flash (-1 if
+// unknown).  Returns 0 if the slot has no usable space.
+uint32_t multibootSlotSize(const struct multiboot *mb, int slot, int64_t flash_bytes);
+
+// Erase and program slot `slot` with `data`, touching only the sectors
+// the slot occupies.  Bytes in those sectors that belong to the header
+// or to a neighbouring slot are read back first and kept.
+// Returns 0 on success.
+int multibootWriteSlot(struct ff_spi *spi, const struct multiboot *mb, int slot,
+                       const uint8_t *data, uint32_t count, int quiet);
+
+#endif /* FF_MULTIBOOT_H_ */
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "digest.h"
+#include "ice40.h"
+#include "patchcache.h"
+
+// Bump this whenever ice40_patch() changes what it writes, so stale
+// entries are never used.
+#define PATCHCACHE_VERSION "fomu-flash patched bitstream v1"
+
+struct patchcache_entry {
+    char name[96];
+    off_t size;
+    struct timespec mtime;
+};
+
+static int patchcache_hash_file(struct sha256_ctx *sha, const char *path) {
+    uint8_t bfr[16384];
+    uint64_t length = 0;
+    size_t n;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while ((n = fread(bfr, 1, sizeof(bfr), f)) > 0) {
+        digestSha256Update(sha, bfr, n);
+        length += n;
+    }
+    fclose(f);
+
+    // Include the length so one file's data can't run into the next's
+    digestSha256Update(sha, &length, sizeof(length));
+    return 0;
+}
+
+int patchCacheKey(const char *bitstream, const char *const *rom_files,
+                  const struct ice40_rom *roms, int count, char key[PATCHCACHE_KEY_LEN]) {
+    struct sha256_ctx sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    int i;
+
+    digestSha256Init(&sha);
+    digestSha256Update(&sha, PATCHCACHE_VERSION, sizeof(PATCHCACHE_VERSION));
+    if (patchcache_hash_file(&sha, bitstream))
+        return -1;
+    for (i = 0; i < count; i++) {
+        uint32_t params[2] = { roms[i].size, roms[i].seed ? roms[i].seed : 1 };
+        digestSha256Update(&sha, params, sizeof(params));
+        if (patchcache_hash_file(&sha, rom_files[i]))
+            return -1;
+    }
+    digestSha256Final(&sha, digest);
+    digestToHex(digest, sizeof(digest), key);
+    return 0;
+}
+
+uint8_t *patchCacheGet(const struct patch_cache *pc, const char *key, uint32_t *length) {
+    char cache_dir[4096];
+    char path[4096 + 128];
+    struct stat st;
+    uint8_t *data;
+    int fd;
+
+    if (cacheDir(pc->dir, cache_dir, sizeof(cache_dir)))
+        return NULL;
+    snprintf(path, sizeof(path), "%s/patched-%s.bin", cache_dir, key);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if ((fstat(fd, &st) == -1) || !st.st_size) {
+        close(fd);
+        return NULL;
+    }
+    data = malloc(st.st_size);
+    if (!data || (read(fd, data, st.st_size) != st.st_size)) {
+        free(data);
+        close(fd);
+        return NULL;
+    }
+
+    // The modification time doubles as the last-used time for eviction
+    futimens(fd, NULL);
+    close(fd);
+    *length = st.st_size;
+    return data;
+}
+
+static int patchcache_compare_age(const void *a, const void *b) {
+    const struct patchcache_entry *x = a;
+    const struct patchcache_entry *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return (x->mtime.tv_sec > y->mtime.tv_sec) ? 1 : -1;
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+// Remove the least recently used entries until at most `max_bytes`
+// remain.  The most recent entry is always kept.
+static void patchcache_evict(const char *cache_dir, uint64_t max_bytes) {
+    struct patchcache_entry *entries = NULL;
+    struct dirent *de;
+    uint64_t total = 0;
+    int count = 0;
+    int i;
+    DIR *d = opendir(cache_dir);
+
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        char path[4096 + 128];
+        struct stat st;
+        struct patchcache_entry *grown;
+        size_t len = strlen(de->d_name);
+
+        if (strncmp(de->d_name, "patched-", 8) || (len < 12) || (len >= sizeof(entries->name))
+         || strcmp(de->d_name + len - 4, ".bin"))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+        if (stat(path, &st) == -1)
+            continue;
+        grown = realloc(entries, (count + 1) * sizeof(*entries));
+        if (!grown)
+            break;
+        entries = grown;
+        strcpy(entries[count].name, de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+
+    qsort(entries, count, sizeof(*entries), patchcache_compare_age);
+    for (i = 0; (i < count - 1) && (total > max_bytes); i++) {
+        char path[4096 + 128];
+        snprintf(path, sizeof(path), "%s/%s", cache_dir, entries[i].name);
+        if (unlink(path) == 0)
+            total -= entries[i].size;
+    }
+    free(entries);
+}
+
+int patchCachePut(const struct patch_cache *pc, const char *key,
+                  const uint8_t *data, uint32_t length) {
+    char cache_dir[4096];
+    char path[4096 + 128];
+
+    if (cacheDir(pc->dir, cache_dir, sizeof(cache_dir)))
+        return -1;
+    snprintf(path, sizeof(path), "%s/patched-%s.bin", cache_dir, key);
+    if (cacheWriteFile(path, data, length))
+        return -1;
+    patchcache_evict(cache_dir, pc->max_bytes);
+    return 0;
+}
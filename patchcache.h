@@ -0,0 +1,34 @@
+#ifndef FF_PATCHCACHE_H_
+#define FF_PATCHCACHE_H_
+
+#include <stdint.h>
+
+#include "digest.h"
+
+struct ice40_rom;
+
+// Default limit on the total size of cached patched bitstreams
+#define PATCHCACHE_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+
+#define PATCHCACHE_KEY_LEN (SHA256_DIGEST_SIZE * 2 + 1)
+
+struct patch_cache {
+    const char *dir;        // NULL for the default cache directory
+    uint64_t max_bytes;     // Evict old entries beyond this total size
+};
+
+// Hash a bitstream, the ROMs to be patched into it and their sizes and
+// seeds into the key of the patched result.  Returns 0 on success.
+int patchCacheKey(const char *bitstream, const char *const *rom_files,
+                  const struct ice40_rom *roms, int count, char key[PATCHCACHE_KEY_LEN]);
+
+// Look up a patched bitstream.  On a hit it is marked as recently used
+// and returned, to be freed by the caller.  Returns NULL on a miss.
+uint8_t *patchCacheGet(const struct patch_cache *pc, const char *key, uint32_t *length);
+
+// Store a patched bitstream, then evict the least recently used ones
+// until the cache is back under its size limit.  Returns 0 on success.
+int patchCachePut(const struct patch_cache *pc, const char *key,
+                  const uint8_t *data, uint32_t length);
+
+#endif /* FF_PATCHCACHE_H_ */
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+
+// Enough to cover the VLAs used by the bitstream patcher.
+#define RT_STACK_PREFAULT (256 * 1024)
+
+static uint64_t rt_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Return the first CPU listed in the kernel's "isolcpus" set, or -1.
+static int rt_isolated_cpu(void) {
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    int cpu = -1;
+    if (!f)
+        return -1;
+    if (fscanf(f, "%d", &cpu) != 1)
+        cpu = -1;
+    fclose(f);
+    return cpu;
+}
+
+static void rt_prefault_stack(void) {
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+    for (i = 0; i < sizeof(stack); i += page)
+        stack[i] = 0;
+}
+
+int rtEnable(int cpu) {
+    int failures = 0;
+    cpu_set_t set;
+    struct sched_param param;
+
+    if (cpu < 0) {
+        cpu = rt_isolated_cpu();
+        if (cpu < 0) {
+            cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+            fprintf(stderr, "rt: no isolated cores (boot with isolcpus=), using cpu %d\n", cpu);
+            failures++;
+        }
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        fprintf(stderr, "rt: unable to pin to cpu %d: %s\n", cpu, strerror(errno));
+        failures++;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+        fprintf(stderr, "rt: unable to set SCHED_FIFO: %s\n", strerror(errno));
+        failures++;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        fprintf(stderr, "rt: unable to lock memory: %s\n", strerror(errno));
+        failures++;
+    }
+
+    rt_prefault_stack();
+
+    if (failures)
+        fprintf(stderr, "rt: running with %d real-time guarantee(s) missing\n", failures);
+    return failures;
+}
+
+void rtPrefault(void *buf, size_t len) {
+    volatile uint8_t *b = buf;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    if (!b || !len)
+        return;
+    for (i = 0; i < len; i += page)
+        b[i] = b[i];
+    b[len - 1] = b[len - 1];
+}
+
+struct rt_jitter rtMeasureJitter(uint32_t duration_ms) {
+    struct rt_jitter j;
+    uint64_t start, last, now;
+
+    memset(&j, 0, sizeof(j));
+    start = last = rt_now_us();
+    do {
+        uint32_t gap;
+        now = rt_now_us();
+        gap = now - last;
+        if (gap > j.max_us)
+            j.max_us = gap;
+        if (gap > RT_JITTER_GAP_US) {
+            j.gaps++;
+            j.stalled_us += gap;
+        }
+        j.samples++;
+        last = now;
+    } while (now - start < (uint64_t)duration_ms * 1000);
+    return j;
+}
+
+void rtPrintJitter(FILE *stream, const char *label, const struct rt_jitter *j) {
+    fprintf(stream, "jitter %-7s max %u us, %u gaps > %d us, %llu us stalled (%u samples)\n",
+            label, j->max_us, j->gaps, RT_JITTER_GAP_US,
+            (unsigned long long)j->stalled_us, j->samples);
+}
@@ -0,0 +1,34 @@
+#ifndef FF_RT_H_
+#define FF_RT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Gaps between consecutive clock samples longer than this are
+// counted as a scheduler preemption.
+#define RT_JITTER_GAP_US 50
+
+struct rt_jitter {
+    uint32_t samples;
+    uint32_t gaps;          // Number of gaps longer than RT_JITTER_GAP_US
+    uint32_t max_us;        // Longest gap seen
+    uint64_t stalled_us;    // Sum of all gaps longer than RT_JITTER_GAP_US
+};
+
+// Pin the calling thread to `cpu` (or an isolated core if `cpu` is
+// negative), switch it to SCHED_FIFO and lock all memory.  Returns the
+// number of guarantees that could not be obtained, each of which is
+// reported on stderr.
+int rtEnable(int cpu);
+
+// Touch every page of a buffer so that no page faults occur while
+// bit-banging into or out of it.
+void rtPrefault(void *buf, size_t len);
+
+// Spin for `duration_ms` and record how long the thread was kept off
+// the CPU.
+struct rt_jitter rtMeasureJitter(uint32_t duration_ms);
+void rtPrintJitter(FILE *stream, const char *label, const struct rt_jitter *j);
+
+#endif /* FF_RT_H_ */
@@ -0,0 +1,353 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "spi.h"
+#include "verify.h"
+#include "segments.h"
+
+#define SEGMENT_PAGE_SIZE 256
+#define SEGMENT_VERIFY_CHUNK 65536
+
+#define UF2_MAGIC_START0 0x0a324655
+#define UF2_MAGIC_START1 0x9e5d5157
+#define UF2_MAGIC_END    0x0ab16f30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int segments_add(struct segment_list *l, uint32_t addr,
+                        const uint8_t *data, uint32_t length) {
+    struct segment *segs = realloc(l->segs, (l->count + 1) * sizeof(*segs));
+    if (!segs)
+        return -1;
+    l->segs = segs;
+    segs[l->count].addr = addr;
+    segs[l->count].length = length;
+    segs[l->count].data = malloc(length ? length : 1);
+    if (!segs[l->count].data)
+        return -1;
+    memcpy(segs[l->count].data, data, length);
+    l->count++;
+    return 0;
+}
+
+static uint8_t *segments_read_file(const char *path, uint32_t *length) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+    long len;
+
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(len ? len : 1);
+    if (!data || (fread(data, 1, len, f) != (size_t)len)) {
+        fprintf(stderr, "unable to read %s\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *length = len;
+    return data;
+}
+
+static int hex_byte(const char *p) {
+    unsigned int v;
+    if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+        return -1;
+    sscanf(p, "%2x", &v);
+    return v;
+}
+
+static int segments_parse_ihex(struct segment_list *l, const char *text, const char *path) {
+    uint32_t base = 0;
+    int line = 0;
+
+    while (*text) {
+        uint8_t rec[256 + 5];
+        int len, i, sum = 0;
+
+        line++;
+        while (*text && isspace((unsigned char)*text))
+            text++;
+        if (!*text)
+            break;
+        if (*text != ':') {
+            fprintf(stderr, "%s:%d: expected ':'\n", path, line);
+            return -1;
+        }
+        text++;
+        len = hex_byte(text);
+        if (len < 0) {
+            fprintf(stderr, "%s:%d: bad record\n", path, line);
+            return -1;
+        }
+        for (i = 0; i < len + 5; i++) {
+            int b = hex_byte(text + i * 2);
+            if (b < 0) {
+                fprintf(stderr, "%s:%d: bad record\n", path, line);
+                return -1;
+            }
+            rec[i] = b;
+            sum += b;
+        }
+        text += (len + 5) * 2;
+        if (sum & 0xff) {
+            fprintf(stderr, "%s:%d: bad checksum\n", path, line);
+            return -1;
+        }
+
+        uint32_t offset = (rec[1] << 8) | rec[2];
+        switch (rec[3]) {
+        case 0x00: // Data
+            if (segments_add(l, base + offset, rec + 4, len))
+                return -1;
+            break;
+        case 0x01: // End of file
+            return 0;
+        case 0x02: // Extended segment address
+            base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x04: // Extended linear address
+            base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        case 0x03: // Start segment address
+        case 0x05: // Start linear address
+            break;
+        default:
+            fprintf(stderr, "%s:%d: unrecognized record type %02x\n", path, line, rec[3]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int segments_parse_uf2(struct segment_list *l, const uint8_t *data,
+                              uint32_t length, const char *path) {
+    uint32_t offset;
+
+    for (offset = 0; offset + 512 <= length; offset += 512) {
+        const uint8_t *block = data + offset;
+        uint32_t payload = get32(block + 16);
+        if ((get32(block + 0) != UF2_MAGIC_START0)
+         || (get32(block + 4) != UF2_MAGIC_START1)
+         || (get32(block + 508) != UF2_MAGIC_END)
+         || (payload > 476)) {
+            fprintf(stderr, "%s: bad UF2 block @ %u\n", path, offset);
+            return -1;
+        }
+        if (get32(block + 8) & UF2_FLAG_NOT_MAIN_FLASH)
+            continue;
+        if (segments_add(l, get32(block + 12), block + 32, payload))
+            return -1;
+    }
+    return 0;
+}
+
+static int segments_parse_manifest(struct segment_list *l, char *text, const char *path) {
+    char *line = strtok(text, "\n");
+    int n = 0;
+
+    for (; line; line = strtok(NULL, "\n")) {
+        char file[1024];
+        char *end;
+        uint32_t addr;
+        uint32_t length;
+        uint8_t *data;
+        int ret;
+
+        n++;
+        while (isspace((unsigned char)*line))
+            line++;
+        if (!*line || (*line == '#'))
+            continue;
+        addr = strtoul(line, &end, 0);
+        if ((end == line) || (sscanf(end, "%1023s", file) != 1)) {
+            fprintf(stderr, "%s:%d: expected \"addr file\"\n", path, n);
+            return -1;
+        }
+        data = segments_read_file(file, &length);
+        if (!data)
+            return -1;
+        ret = segments_add(l, addr, data, length);
+        free(data);
+        if (ret)
+            return -1;
+    }
+    return 0;
+}
+
+static int segments_compare(const void *a, const void *b) {
+    const struct segment *sa = a;
+    const struct segment *sb = b;
+    if (sa->addr < sb->addr)
+        return -1;
+    return sa->addr > sb->addr;
+}
+
+// Sort by address, then merge any segments that share a page (filling
+// gaps with 0xff) and pad the first segment of each run back to a page
+// boundary, since page programs can't start mid-page.
+static int segments_normalise(struct segment_list *l) {
+    int in, out = 0;
+
+    qsort(l->segs, l->count, sizeof(*l->segs), segments_compare);
+    for (in = 0; in < l->count; in++) {
+        struct segment *s = &l->segs[in];
+        uint32_t pad = s->addr % SEGMENT_PAGE_SIZE;
+
+        if (out) {
+            struct segment *prev = &l->segs[out - 1];
+            uint32_t prev_end = prev->addr + prev->length;
+            uint32_t page_end = (prev_end + SEGMENT_PAGE_SIZE - 1) & ~(SEGMENT_PAGE_SIZE - 1);
+            if (s->addr < prev_end) {
+                fprintf(stderr, "segments overlap @ 0x%08x\n", s->addr);
+                return -1;
+            }
+            if (s->addr < page_end || s->addr == prev_end) {
+                uint32_t new_length = s->addr + s->length - prev->addr;
+                uint8_t *data = realloc(prev->data, new_length);
+                if (!data)
+                    return -1;
+                memset(data + prev->length, 0xff, s->addr - prev_end);
+                memcpy(data + (s->addr - prev->addr), s->data, s->length);
+                prev->data = data;
+                prev->length = new_length;
+                free(s->data);
+                continue;
+            }
+        }
+
+        if (pad) {
+            uint8_t *data = malloc(s->length + pad);
+            if (!data)
+                return -1;
+            memset(data, 0xff, pad);
+            memcpy(data + pad, s->data, s->length);
+            free(s->data);
+            s->data = data;
+            s->addr -= pad;
+            s->length += pad;
+        }
+        l->segs[out++] = *s;
+    }
+    l->count = out;
+    return 0;
+}
+
+int segmentsLoad(struct segment_list *l, const char *path) {
+    uint32_t length;
+    uint8_t *data;
+    int ret;
+
+    memset(l, 0, sizeof(*l));
+    data = segments_read_file(path, &length);
+    if (!data)
+        return -1;
+
+    if ((length >= 512) && (get32(data) == UF2_MAGIC_START0))
+        ret = segments_parse_uf2(l, data, length, path);
+    else {
+        // Both text formats need a terminator
+        char *text = realloc(data, length + 1);
+        if (!text) {
+            free(data);
+            return -1;
+        }
+        data = (uint8_t *)text;
+        text[length] = '\0';
+        while (isspace((unsigned char)*text))
+            text++;
+        if (*text == ':')
+            ret = segments_parse_ihex(l, text, path);
+        else
+            ret = segments_parse_manifest(l, text, path);
+    }
+    free(data);
+
+    if (!ret && !l->count) {
+        fprintf(stderr, "%s: no segments found\n", path);
+        ret = -1;
+    }
+    if (!ret)
+        ret = segments_normalise(l);
+    if (ret)
+        segmentsFree(l);
+    return ret;
+}
+
+void segmentsFree(struct segment_list *l) {
+    int i;
+    for (i = 0; i < l->count; i++)
+        free(l->segs[i].data);
+    free(l->segs);
+    l->segs = NULL;
+    l->count = 0;
+}
+
+int segmentsWrite(struct ff_spi *spi, const struct segment_list *l, int quiet) {
+    uint32_t sector_size = spiEraseSize(spi);
+    uint32_t erase_start = 0;
+    uint32_t erase_end = 0;
+    int i;
+    int ret = 0;
+
+    // Build the erase plan by merging the sector ranges of each segment
+    for (i = 0; (i <= l->count) && !ret; i++) {
+        uint32_t start = 0, end = 0;
+        if (i < l->count) {
+            start = l->segs[i].addr - (l->segs[i].addr % sector_size);
+            end = l->segs[i].addr + l->segs[i].length;
+            end = ((end + sector_size - 1) / sector_size) * sector_size;
+            if (i && (start <= erase_end)) {
+                erase_end = end;
+                continue;
+            }
+        }
+        if (i)
+            ret = spiErase(spi, erase_start, erase_end - erase_start, quiet);
+        erase_start = start;
+        erase_end = end;
+    }
+
+    for (i = 0; (i < l->count) && !ret; i++)
+        ret = spiProgram(spi, l->segs[i].addr, l->segs[i].data, l->segs[i].length, quiet);
+    return ret;
+}
+
+int segmentsVerify(struct ff_spi *spi, const struct segment_list *l,
+                   struct verify_report *report, int fail_fast) {
+    uint8_t *bfr = malloc(SEGMENT_VERIFY_CHUNK);
+    int i;
+
+    if (!bfr) {
+        perror("unable to allocate memory for verify");
+        return -1;
+    }
+
+    for (i = 0; i < l->count; i++) {
+        const struct segment *s = &l->segs[i];
+        uint32_t offset;
+        for (offset = 0; offset < s->length; offset += SEGMENT_VERIFY_CHUNK) {
+            uint32_t len = s->length - offset;
+            if (len > SEGMENT_VERIFY_CHUNK)
+                len = SEGMENT_VERIFY_CHUNK;
+            spiRead(spi, s->addr + offset, bfr, len);
+            if (verifyChunk(report, s->addr + offset, s->data + offset, bfr, len) && fail_fast) {
+                free(bfr);
+                return 0;
+            }
+        }
+    }
+    free(bfr);
+    return 0;
+}
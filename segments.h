@@ -0,0 +1,36 @@
+#ifndef FF_SEGMENTS_H_
+#define FF_SEGMENTS_H_
+
+#include <stdint.h>
+
+struct ff_spi;
+struct verify_report;
+
+struct segment {
+    uint32_t addr;
+    uint32_t length;
+    uint8_t *data;
+};
+
+struct segment_list {
+    struct segment *segs;
+    int count;
+};
+
+// Load a set of segments from `path`, which may be an Intel HEX file,
+// a UF2 file, or a text manifest with one "addr file" pair per line.
+// The segments are sorted, page-aligned, and merged where they share a
+// page.  Returns 0 on success.
+int segmentsLoad(struct segment_list *l, const char *path);
+void segmentsFree(struct segment_list *l);
+
+// Erase every sector touched by any segment exactly once, then program
+// the segments in address order.  Returns 0 on success.
+int segmentsWrite(struct ff_spi *spi, const struct segment_list *l, int quiet);
+
+// Read back every segment and compare it in a single report.  Returns
+// 0 if the segments could be read back, whether or not they matched.
+int segmentsVerify(struct ff_spi *spi, const struct segment_list *l,
+                   struct verify_report *report, int fail_fast);
+
+#endif /* FF_SEGMENTS_H_ */
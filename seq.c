@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rpi.h"
+#include "spi.h"
+#include "fpga.h"
+#include "image.h"
+#include "seq.h"
+
+#define SEQ_UART_BUFFER 4096
+
+static int seq_parse_option(struct seq_step *st, const char *opt) {
+    char *end;
+
+    if (!strncmp(opt, "gpio=", 5)) {
+        st->gpio = strtol(opt + 5, &end, 0);
+        if (end == opt + 5)
+            return -1;
+        if (*end == ':')
+            st->gpio_level = !!strtol(end + 1, &end, 0);
+        return *end ? -1 : 0;
+    }
+    if (!strncmp(opt, "uart=", 5)) {
+        if (!opt[5])
+            return -1;
+        st->uart = strdup(opt + 5);
+        return 0;
+    }
+    if (!strncmp(opt, "timeout=", 8)) {
+        st->timeout_ms = strtoul(opt + 8, &end, 0);
+        return (*end || (end == opt + 8)) ? -1 : 0;
+    }
+    return -1;
+}
+
+static int seq_preload(struct seq_step *st, int *locked) {
+    struct image *img = imageOpen(st->path);
+    if (!img) {
+        perror(st->path);
+        return -1;
+    }
+    st->data = imageReadAll(img, &st->length);
+    imageClose(&img);
+    if (!st->data) {
+        fprintf(stderr, "%s: unable to read bitstream\n", st->path);
+        return -1;
+    }
+
+    // Keep the bitstream resident so booting it never page-faults
+    if (mlock(st->data, st->length) == -1)
+        *locked = 0;
+    return 0;
+}
+
+int seqLoad(struct sequence *seq, const char *path) {
+    char line[1024];
+    int locked = 1;
+    int n = 0;
+    FILE *f;
+
+    memset(seq, 0, sizeof(*seq));
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        struct seq_step *st;
+        char *tok;
+
+        n++;
+        tok = strtok(line, " \t\r\n");
+        if (!tok || (*tok == '#'))
+            continue;
+
+        st = realloc(seq->steps, (seq->count + 1) * sizeof(*st));
+        if (!st)
+            goto err;
+        seq->steps = st;
+        st = &seq->steps[seq->count++];
+        memset(st, 0, sizeof(*st));
+        st->path = strdup(tok);
+        st->gpio = -1;
+        st->gpio_level = 1;
+        st->timeout_ms = SEQ_DEFAULT_TIMEOUT_MS;
+
+        while ((tok = strtok(NULL, " \t\r\n"))) {
+            if (seq_parse_option(st, tok)) {
+                fprintf(stderr, "%s:%d: unrecognized option \"%s\"\n", path, n, tok);
+                goto err;
+            }
+        }
+        if (seq_preload(st, &locked))
+            goto err;
+    }
+    fclose(f);
+
+    if (!seq->count) {
+        fprintf(stderr, "%s: no steps found\n", path);
+        return -1;
+    }
+    if (!locked)
+        fprintf(stderr, "sequence: unable to lock bitstreams in memory\n");
+    return 0;
+
+err:
+    fclose(f);
+    seqFree(seq);
+    return -1;
+}
+
+static int seq_open_uart(const char *dev) {
+    struct termios tio;
+    int fd = open(dev, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1) {
+        perror(dev);
+        return -1;
+    }
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    return fd;
+}
+
+// Wait for every pass signal the step asked for.  Returns the
+// microseconds it took after CDONE, or -1 if the step timed out.
+static int seq_wait_pass(struct seq_step *st, int uart_fd, const char **why) {
+    char uart[SEQ_UART_BUFFER];
+    size_t uart_len = 0;
+    int gpio_ok = (st->gpio == -1);
+    int uart_ok = !st->uart;
+    uint32_t start = gpioTick();
+    uint32_t elapsed;
+
+    do {
+        elapsed = gpioTick() - start;
+        if (!gpio_ok)
+            gpio_ok = (gpioRead(st->gpio) == st->gpio_level);
+        if (!uart_ok) {
+            struct pollfd pfd = { .fd = uart_fd, .events = POLLIN };
+            ssize_t got;
+
+            poll(&pfd, 1, 1);
+            got = read(uart_fd, uart + uart_len, sizeof(uart) - 1 - uart_len);
+            if (got > 0) {
+                uart_len += got;
+                uart_ok = !!memmem(uart, uart_len, st->uart, strlen(st->uart));
+
+                // Keep only enough to match text split across reads
+                if (uart_len > sizeof(uart) / 2) {
+                    size_t keep = strlen(st->uart);
+                    memmove(uart, uart + uart_len - keep, keep);
+                    uart_len = keep;
+                }
+            }
+        }
+        if (gpio_ok && uart_ok)
+            return elapsed;
+    } while (elapsed < st->timeout_ms * 1000);
+
+    *why = !gpio_ok ? "no pass signal on gpio" : "no pass message on uart";
+    return -1;
+}
+
+int seqRun(struct sequence *seq, struct ff_spi *spi, struct ff_fpga *fpga,
+           const char *uart_dev, int quiet) {
+    uint32_t start = gpioTick();
+    int uart_fd = -1;
+    int passed = 0;
+    int i;
+
+    for (i = 0; i < seq->count; i++) {
+        if (seq->steps[i].gpio != -1)
+            gpioSetMode(seq->steps[i].gpio, PI_INPUT);
+        if (seq->steps[i].uart && (uart_fd == -1)) {
+            uart_fd = seq_open_uart(uart_dev);
+            if (uart_fd == -1)
+                return 1;
+        }
+    }
+
+    for (i = 0; i < seq->count; i++) {
+        struct seq_step *st = &seq->steps[i];
+        const char *why = NULL;
+        uint32_t step_start = gpioTick();
+        int boot_us;
+        int pass_us = 0;
+
+        // Old output from the previous step mustn't count as a pass
+        if (uart_fd != -1)
+            tcflush(uart_fd, TCIFLUSH);
+
+        fpgaSlaveBegin(fpga, spi);
+        spiTxBuffer(spi, st->data, st->length);
+        boot_us = fpgaSlaveFinish(fpga, spi, NULL);
+        if (boot_us < 0)
+            why = "CDONE never rose";
+        else
+            pass_us = seq_wait_pass(st, uart_fd, &why);
+
+        printf("step %d/%d %s: ", i + 1, seq->count, st->path);
+        if (boot_us >= 0)
+            printf("cdone %d us, ", boot_us);
+        if (!why && ((st->gpio != -1) || st->uart))
+            printf("pass signal %d us, ", pass_us);
+        printf("total %u us: ", gpioTick() - step_start);
+        if (why) {
+            printf("FAIL (%s)\n", why);
+            break;
+        }
+        printf("pass\n");
+        passed++;
+    }
+
+    if (uart_fd != -1)
+        close(uart_fd);
+    if (!quiet || (passed != seq->count))
+        printf("sequence: %d of %d step(s) passed in %u ms\n",
+               passed, seq->count, (gpioTick() - start) / 1000);
+    return passed != seq->count;
+}
+
+void seqFree(struct sequence *seq) {
+    int i;
+    for (i = 0; i < seq->count; i++) {
+        if (seq->steps[i].data) {
+            munlock(seq->steps[i].data, seq->steps[i].length);
+            free(seq->steps[i].data);
+        }
+        free(seq->steps[i].path);
+        free(seq->steps[i].uart);
+    }
+    free(seq->steps);
+    memset(seq, 0, sizeof(*seq));
+}
@@ -0,0 +1,39 @@
+#ifndef FF_SEQ_H_
+#define FF_SEQ_H_
+
+#include <stdint.h>
+
+// How long a step's pass signal has to appear, if not given
+#define SEQ_DEFAULT_TIMEOUT_MS 5000
+
+struct ff_spi;
+struct ff_fpga;
+
+struct seq_step {
+    char *path;
+    uint8_t *data;          // The bitstream, preloaded and locked
+    uint32_t length;
+    int gpio;               // Pin that signals a pass, or -1
+    int gpio_level;         // Level on `gpio` that means a pass
+    char *uart;             // Text the UART prints on a pass, or NULL
+    uint32_t timeout_ms;    // How long to wait for the pass signals
+};
+
+struct sequence {
+    struct seq_step *steps;
+    int count;
+};
+
+// Parse a sequence file and preload every bitstream into locked memory.
+// Each line is "bitstream [gpio=pin[:level]] [uart=text] [timeout=ms]".
+int seqLoad(struct sequence *seq, const char *path);
+
+// Boot each step in turn over the slave configuration port, waiting
+// for CDONE and then any pass signals.  Stops at the first failure.
+// Returns 0 if every step passed.
+int seqRun(struct sequence *seq, struct ff_spi *spi, struct ff_fpga *fpga,
+           const char *uart_dev, int quiet);
+
+void seqFree(struct sequence *seq);
+
+#endif /* FF_SEQ_H_ */
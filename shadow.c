@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "spi.h"
+#include "cache.h"
+#include "digest.h"
+#include "memscan.h"
+#include "shadow.h"
+
+struct shadow {
+    uint32_t addr;
+    uint32_t length;
+    uint8_t *data;
+};
+
+static void shadow_paths(const char *dir, const uint8_t serial[4],
+                         char *data_path, char *meta_path, size_t len) {
+    snprintf(data_path, len, "%s/shadow-%02x%02x%02x%02x.bin", dir,
+             serial[0], serial[1], serial[2], serial[3]);
+    snprintf(meta_path, len, "%s/shadow-%02x%02x%02x%02x.meta", dir,
+             serial[0], serial[1], serial[2], serial[3]);
+}
+
+// Load a shadow and make sure it matches the hash recorded when it
+// was written.  Returns 0 on success.
+static int shadow_load(struct shadow *s, const char *data_path, const char *meta_path) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    char expected_hex[sizeof(hex)];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    FILE *meta;
+    int fd;
+
+    memset(s, 0, sizeof(*s));
+    meta = fopen(meta_path, "r");
+    if (!meta)
+        return -1;
+    if (fscanf(meta, "addr %x length %u sha256 %64s", &s->addr, &s->length, expected_hex) != 3) {
+        fclose(meta);
+        return -1;
+    }
+    fclose(meta);
+
+    fd = open(data_path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    s->data = malloc(s->length);
+    if (!s->data || (read(fd, s->data, s->length) != (ssize_t)s->length)) {
+        close(fd);
+        free(s->data);
+        s->data = NULL;
+        return -1;
+    }
+    close(fd);
+
+    digestSha256(s->data, s->length, digest);
+    digestToHex(digest, sizeof(digest), hex);
+    if (strcmp(hex, expected_hex)) {
+        fprintf(stderr, "shadow: %s is corrupt, ignoring it\n", data_path);
+        free(s->data);
+        s->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// The data is renamed into place before the metadata, so a crash in
+// between leaves a shadow whose hash doesn't match and gets ignored.
+static int shadow_save(const char *data_path, const char *meta_path,
+                       uint32_t addr, const uint8_t *data, uint32_t count) {
+    char meta[256];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    int len;
+
+    digestSha256(data, count, digest);
+    digestToHex(digest, sizeof(digest), hex);
+    len = snprintf(meta, sizeof(meta), "addr %08x length %u sha256 %s\n", addr, count, hex);
+
+    unlink(meta_path);
+    if (cacheWriteFile(data_path, data, count))
+        return -1;
+    return cacheWriteFile(meta_path, meta, len);
+}
+
+// Read back a handful of pages spread across the shadowed region and
+// confirm that nobody else has written to this flash since.
+static int shadow_spot_check(struct ff_spi *spi, const struct shadow *s) {
+    uint8_t page[256];
+    uint32_t pages = (s->length + sizeof(page) - 1) / sizeof(page);
+    uint32_t i;
+
+    for (i = 0; i < SHADOW_SPOT_CHECK_PAGES && i < pages; i++) {
+        uint32_t n = (i * pages) / SHADOW_SPOT_CHECK_PAGES;
+
+        // Vary the last sample so repeated runs don't always look
+        // at the same pages.
+        if (i == SHADOW_SPOT_CHECK_PAGES - 1)
+            n = rand() % pages;
+
+        uint32_t offset = n * sizeof(page);
+        uint32_t len = s->length - offset;
+        if (len > sizeof(page))
+            len = sizeof(page);
+
+        spiRead(spi, s->addr + offset, page, len);
+        if (memscanDiff(page, s->data + offset, len) != len)
+            return -1;
+    }
+    return 0;
+}
+
+// Return nonzero if sector `offset` of the new image differs from what
+// the shadow says is in the flash.  Both are padded with 0xff to the
+// end of the sector, since that is what a full write leaves behind.
+static int shadow_sector_changed(const struct shadow *s, const uint8_t *data,
+                                 uint32_t count, uint32_t offset, uint32_t sector_size) {
+    uint32_t new_len = count - offset;
+    uint32_t old_len;
+
+    if (offset >= s->length)
+        return 1;
+    old_len = s->length - offset;
+    if (new_len > sector_size)
+        new_len = sector_size;
+    if (old_len > sector_size)
+        old_len = sector_size;
+
+    if (new_len < old_len) {
+        if (memscanErased(s->data + offset + new_len, old_len - new_len) != old_len - new_len)
+            return 1;
+        old_len = new_len;
+    }
+    else if (new_len > old_len) {
+        if (memscanErased(data + offset + old_len, new_len - old_len) != new_len - old_len)
+            return 1;
+    }
+    return memscanDiff(data + offset, s->data + offset, old_len) != old_len;
+}
+
+int shadowWrite(struct ff_spi *spi, const char *dir, uint32_t addr,
+                const uint8_t *data, uint32_t count, int quiet) {
+    char cache_dir[4096];
+    char data_path[4096 + 32];
+    char meta_path[4096 + 32];
+    struct spi_id id = spiId(spi);
+    uint32_t sector_size = spiEraseSize(spi);
+    struct shadow s;
+    int ret = 0;
+
+    if (!memcmp(id.serial, "\xff\xff\xff\xff", 4) || !memcmp(id.serial, "\0\0\0\0", 4)) {
+        fprintf(stderr, "shadow: flash has no unique ID, doing a full write\n");
+        return spiWrite(spi, addr, data, count, quiet);
+    }
+    if (cacheDir(dir, cache_dir, sizeof(cache_dir)))
+        return spiWrite(spi, addr, data, count, quiet);
+    shadow_paths(cache_dir, id.serial, data_path, meta_path, sizeof(data_path));
+    srand(time(NULL) ^ getpid());
+
+    if (shadow_load(&s, data_path, meta_path)
+     || (s.addr != addr)
+     || (addr % sector_size)
+     || shadow_spot_check(spi, &s)) {
+        if (!quiet)
+            printf("shadow: no valid shadow for %02x%02x%02x%02x, doing a full write\n",
+                   id.serial[0], id.serial[1], id.serial[2], id.serial[3]);
+        ret = spiWrite(spi, addr, data, count, quiet);
+    }
+    else {
+        uint32_t offset;
+        uint32_t run_start = 0;
+        int in_run = 0;
+        uint32_t changed = 0;
+        uint32_t total = 0;
+
+        // Write each contiguous run of changed sectors
+        for (offset = 0; offset < count && !ret; offset += sector_size) {
+            int dirty = shadow_sector_changed(&s, data, count, offset, sector_size);
+            total++;
+            if (dirty) {
+                changed++;
+                if (!in_run)
+                    run_start = offset;
+                in_run = 1;
+            }
+            else if (in_run) {
+                ret = spiWrite(spi, addr + run_start, data + run_start, offset - run_start, quiet);
+                in_run = 0;
+            }
+        }
+        if (in_run && !ret)
+            ret = spiWrite(spi, addr + run_start, data + run_start, count - run_start, quiet);
+        if (!quiet)
+            printf("shadow: %u of %u sector(s) changed\n", changed, total);
+    }
+    free(s.data);
+
+    if (!ret)
+        shadow_save(data_path, meta_path, addr, data, count);
+    else
+        unlink(meta_path);
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef FF_SHADOW_H_
+#define FF_SHADOW_H_
+
+#include <stdint.h>
+
+struct ff_spi;
+
+// Number of pages read back to confirm that a shadow still matches
+// the flash before trusting it.
+#define SHADOW_SPOT_CHECK_PAGES 8
+
+// Write `data` to the flash at `addr`, using a host-side copy of what
+// was last written to this chip (keyed by its unique ID) to erase and
+// program only the sectors that changed.  Falls back to a full write if
+// there is no usable shadow.  `dir` may be NULL to use the default
+// cache directory.  Returns 0 on success.
+int shadowWrite(struct ff_spi *spi, const char *dir, uint32_t addr,
+                const uint8_t *data, uint32_t count, int quiet);
+
+#endif /* FF_SHADOW_H_ */
@@ -53,6 +53,9 @@ struct ff_spi {
 	int size_override;
 	uint8_t unlock_cmd;
 
+	void (*progress_hook)(void *data, enum spi_progress what, uint32_t addr);
+	void *progress_data;
+
 	struct {
 		int clk;
 		int d0;
@@ -201,6 +204,67 @@ static uint8_t spiXfer(struct ff_spi *spi, uint8_t out) {
 	return in;
 }
 
+// Bank-1 masks for CLK and MOSI, or 0 if either pin is in bank 2
+static uint32_t spi_bank1_bit(int pin) {
+	return (pin >= 0 && pin < 32) ? (1 << pin) : 0;
+}
+
+int spiTxBuffer(struct ff_spi *spi, const uint8_t *data, unsigned int count) {
+	uint32_t clk = spi_bank1_bit(spi->pins.clk);
+	uint32_t mosi = spi_bank1_bit(spi->pins.mosi);
+	unsigned int i;
+	int bit;
+
+	if ((spi->type != ST_SINGLE) || !clk || !mosi) {
+		for (i = 0; i < count; i++)
+			if (spiTx(spi, data[i]))
+				return -1;
+		return 0;
+	}
+
+	// Nothing is read back, so each bit is just the data change (made
+	// in the same write that drops CLK when it is a 0) and a rising edge.
+	// Reading GPLEV0 after each half makes the write land before the next
+	// one starts, like the read-backs in spiXfer(), so SCK can't outrun
+	// the bus no matter how fast the CPU is.
+	spi_set_state(spi, SS_SINGLE);
+	for (i = 0; i < count; i++) {
+		uint8_t out = data[i];
+		for (bit = 7; bit >= 0; bit--) {
+			if (out & (1 << bit)) {
+				gpioClearBank1(clk);
+				gpioSetBank1(mosi);
+			}
+			else
+				gpioClearBank1(clk | mosi);
+			gpioReadBank1();
+			gpioSetBank1(clk);
+			gpioReadBank1();
+		}
+	}
+	gpioClearBank1(clk);
+	return 0;
+}
+
+void spiClock(struct ff_spi *spi, unsigned int cycles) {
+	uint32_t clk = spi_bank1_bit(spi->pins.clk);
+
+	spi_set_state(spi, SS_SINGLE);
+	gpioWrite(spi->pins.mosi, 1);
+	while (cycles--) {
+		if (clk) {
+			gpioSetBank1(clk);
+			gpioReadBank1();
+			gpioClearBank1(clk);
+			gpioReadBank1();
+		}
+		else {
+			gpioWrite(spi->pins.clk, 1);
+			gpioWrite(spi->pins.clk, 0);
+		}
+	}
+}
+
 static void spiSingleTx(struct ff_spi *spi, uint8_t out) {
 	spi_set_state(spi, SS_SINGLE);
 	spiXfer(spi, out);
@@ -725,6 +789,11 @@ void spiOverrideSize(struct ff_spi *spi, uint32_t size) {
 		spi->id.bytes = size;
 }
 
+uint32_t spiEraseSize(struct ff_spi *spi) {
+	(void)spi;
+	return ERASE_BLOCK_SIZE;
+}
+
 int spiSetType(struct ff_spi *spi, enum spi_type type) {
 
 	if (spi->type == type)
@@ -955,9 +1024,7 @@ void spiSwapTxRx(struct ff_spi *spi) {
 	spi_set_state(spi, SS_SINGLE);
 }
 
-int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned int count, int quiet) {
-
-	unsigned int i;
+int spiErase(struct ff_spi *spi, uint32_t addr, unsigned int count, int quiet) {
 
 	if (addr & 0xff) {
 		fprintf(stderr, "Error: Target address is not page-aligned to 256 bytes\n");
@@ -991,9 +1058,23 @@ int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned in
 				}
 			}
 		}
+
+		if (spi->progress_hook)
+			spi->progress_hook(spi->progress_data, SPI_PROGRESS_ERASED, erase_addr);
 	}
 	if (!quiet)
 		printf("  Done\n");
+	return 0;
+}
+
+int spiProgram(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned int count, int quiet) {
+
+	unsigned int i;
+
+	if (addr & 0xff) {
+		fprintf(stderr, "Error: Target address is not page-aligned to 256 bytes\n");
+		return 1;
+	}
 
 	uint8_t write_cmd;
 	switch (spi->type) {
@@ -1039,6 +1120,9 @@ int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned in
 		count -= i;
 		addr += i;
 		spi_wait_for_not_busy(spi, 1000);
+
+		if (spi->progress_hook)
+			spi->progress_hook(spi->progress_data, SPI_PROGRESS_PROGRAMMED, addr);
 	}
 	if (!quiet) {
 		printf("\rProgramming @ %06x / %06x", addr, total);
@@ -1047,6 +1131,20 @@ int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned in
 	return 0;
 }
 
+int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned int count, int quiet) {
+	int ret = spiErase(spi, addr, count, quiet);
+	if (ret)
+		return ret;
+	return spiProgram(spi, addr, data, count, quiet);
+}
+
+void spiSetProgressHook(struct ff_spi *spi,
+			void (*hook)(void *data, enum spi_progress what, uint32_t addr),
+			void *data) {
+	spi->progress_hook = hook;
+	spi->progress_data = data;
+}
+
 uint8_t spiReset(struct ff_spi *spi) {
 	int i;
 
@@ -1141,11 +1239,32 @@ void spiSetPin(struct ff_spi *spi, enum spi_pin pin, int val) {
 	}
 }
 
+int spiGetPin(struct ff_spi *spi, enum spi_pin pin) {
+	switch (pin) {
+	case SP_MOSI: return spi->pins.mosi;
+	case SP_MISO: return spi->pins.miso;
+	case SP_HOLD: return spi->pins.hold;
+	case SP_WP: return spi->pins.wp;
+	case SP_CS: return spi->pins.cs;
+	case SP_CLK: return spi->pins.clk;
+	case SP_D0: return spi->pins.d0;
+	case SP_D1: return spi->pins.d1;
+	case SP_D2: return spi->pins.d2;
+	case SP_D3: return spi->pins.d3;
+	default: return -1;
+	}
+}
+
 void spiSetUnlockCmd(struct  ff_spi *spi, int cmd)
 {
 	spi->unlock_cmd = cmd;
 }
 
+int spiGetUnlockCmd(struct ff_spi *spi)
+{
+	return spi->unlock_cmd;
+}
+
 void spiHold(struct ff_spi *spi) {
 	spiBegin(spi);
 	spiCommand(spi, 0xb9);
@@ -37,6 +37,12 @@ enum spi_pin {
 	SP_D3,
 };
 
+// Reported to the progress hook as spiErase / spiProgram complete work
+enum spi_progress {
+	SPI_PROGRESS_ERASED,		// addr is the erase block that was erased
+	SPI_PROGRESS_PROGRAMMED,	// addr is the end of the page that was programmed
+};
+
 struct spi_id {
 	uint8_t manufacturer_id;	// Result from 0x90
 	uint8_t device_id;		// Result from 0x90
@@ -65,6 +71,10 @@ void spiCommand(struct ff_spi *spi, uint8_t cmd);
 //uint8_t spiDualRx(struct ff_spi *spi);
 //uint8_t spiQuadRx(struct ff_spi *spi);
 int spiTx(struct ff_spi *spi, uint8_t word);
+// Send a whole buffer, with a faster path for single-bit mode
+int spiTxBuffer(struct ff_spi *spi, const uint8_t *data, unsigned int count);
+// Toggle only CLK, with MOSI held high
+void spiClock(struct ff_spi *spi, unsigned int cycles);
 uint8_t spiRx(struct ff_spi *spi);
 uint8_t spiReadStatus(struct ff_spi *spi, uint8_t sr);
 void spiWriteStatus(struct ff_spi *spi, uint8_t sr, uint8_t val);
@@ -75,9 +85,15 @@ int spiRead(struct ff_spi *spi, uint32_t addr, uint8_t *data, unsigned int count
 
 struct spi_id spiId(struct ff_spi *spi);
 void spiOverrideSize(struct ff_spi *spi, uint32_t new_size);
+uint32_t spiEraseSize(struct ff_spi *spi);
 
 //int spi_wait_for_not_busy(struct ff_spi *spi);
 int spiWrite(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned int count, int quiet);
+int spiErase(struct ff_spi *spi, uint32_t addr, unsigned int count, int quiet);
+int spiProgram(struct ff_spi *spi, uint32_t addr, const uint8_t *data, unsigned int count, int quiet);
+void spiSetProgressHook(struct ff_spi *spi,
+			void (*hook)(void *data, enum spi_progress what, uint32_t addr),
+			void *data);
 uint8_t spiReset(struct ff_spi *spi);
 int spiInit(struct ff_spi *spi);
 
@@ -87,7 +103,9 @@ void spiSwapTxRx(struct ff_spi *spi);
 
 struct ff_spi *spiAlloc(void);
 void spiSetPin(struct ff_spi *spi, enum spi_pin pin, int val);
+int spiGetPin(struct ff_spi *spi, enum spi_pin pin);
 void spiSetUnlockCmd(struct  ff_spi *spi, int cmd);
+int spiGetUnlockCmd(struct ff_spi *spi);
 void spiFree(struct ff_spi **spi);
 
 int spiSetQe(struct ff_spi *spi);
@@ -0,0 +1,215 @@
+// Reference patterns are cached between calls to ice40_patch_record(),
+// and a pattern handed to one ROM must never be evicted by a later ROM
+// in the same call.  This builds the cache up with one pass, then patches
+// a bitstream whose second ROM would land in the first ROM's slot if
+// eviction were plain round-robin.
+//
+// The test includes ice40.c itself to get at the pattern generator.
+
+#include <unistd.h>
+
+#include "../ice40.c"
+
+#define TEST_ROM_SIZE 4096
+#define TEST_BLOCK_SIZE 2048
+
+struct buffer {
+    uint8_t *data;
+    size_t length;
+};
+
+static int buffer_write(void *data, const uint8_t *b, size_t count)
+{
+    struct buffer *buf = data;
+    uint8_t *grown = realloc(buf->data, buf->length + count);
+    if (!grown)
+        return -1;
+    memcpy(grown + buf->length, b, count);
+    buf->data = grown;
+    buf->length += count;
+    return 0;
+}
+
+static void buffer_add(struct buffer *buf, const void *data, size_t count)
+{
+    if (buffer_write(buf, data, count)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+// The contents of a ROM as sprayed into BRAM
+static void sprayed(uint8_t *out, const uint8_t *rom)
+{
+    spray(out, rom, TEST_ROM_SIZE);
+}
+
+// The reference pattern for `seed`, as sprayed into BRAM
+static void sprayed_pattern(uint8_t *out, uint32_t seed)
+{
+    uint32_t rand[TEST_ROM_SIZE / 4];
+    fill_rand(rand, TEST_ROM_SIZE, seed);
+    sprayed(out, (const uint8_t *)rand);
+}
+
+// A bitstream with one ROM's worth of BRAM in each bank, `banks[b]`
+// being what is sprayed into bank b
+static void build_bitstream(struct buffer *out, const uint8_t *const *banks, int bank_count)
+{
+    static const uint8_t header[] = {
+        0xff, 0x00, 't', 'e', 's', 't', 0x00, 0xff,
+        0x7e, 0xaa, 0x99, 0x7e,
+        0x51, 0x00,         // Frequency range
+        0x01, 0x05,         // CRC reset
+    };
+    static const uint8_t geometry[] = {
+        0x62, 0x00, 0x7f,   // Width 128
+        0x72, 0x00, 0x80,   // Height 128
+    };
+    struct buffer body = { NULL, 0 };
+    uint16_t crc;
+    int bank;
+    int block;
+    int i;
+
+    buffer_add(&body, "\x92\x00\x20", 3);
+    for (bank = 0; bank < bank_count; bank++) {
+        uint8_t select[] = { 0x11, bank };
+        buffer_add(&body, select, sizeof(select));
+        buffer_add(&body, geometry, sizeof(geometry));
+        for (block = 0; block < TEST_ROM_SIZE / TEST_BLOCK_SIZE; block++) {
+            uint8_t offset[] = { 0x82, 0x00, block * 64 };
+            const uint8_t *words = banks[bank] + block * TEST_BLOCK_SIZE;
+            buffer_add(&body, offset, sizeof(offset));
+            buffer_add(&body, "\x01\x03", 2);
+
+            // BRAM words are sent most significant byte first
+            for (i = 0; i < TEST_BLOCK_SIZE; i += 2) {
+                uint8_t word[] = { words[i + 1], words[i] };
+                buffer_add(&body, word, sizeof(word));
+            }
+            buffer_add(&body, "\x00\x00", 2);
+        }
+    }
+    buffer_add(&body, "\x22", 1);
+    crc = ice40_crc16(0xffff, body.data, body.length);
+
+    out->data = NULL;
+    out->length = 0;
+    buffer_add(out, header, sizeof(header));
+    buffer_add(out, body.data, body.length);
+    buffer_add(out, (uint8_t[]){ crc >> 8, crc & 0xff }, 2);
+    buffer_add(out, "\x01\x06\x00", 3);
+    free(body.data);
+}
+
+static void write_file(const char *path, const void *data, size_t length)
+{
+    FILE *f = fopen(path, "w");
+    if (!f || (fwrite(data, 1, length, f) != length) || fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+// Patch `bitstream` with one ROM per seed, all read from `rom_paths`
+static int patch(const char *bitstream, const char *const *rom_paths,
+                 const uint32_t *seeds, int count, struct buffer *out)
+{
+    struct ice40_rom roms[ICE40_MAX_ROMS];
+    struct irw_file *f = irw_open(bitstream, "r");
+    struct irw_file *o = irw_open_block(out, buffer_write);
+    int ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        roms[i].file = irw_open(rom_paths[i], "r");
+        roms[i].size = TEST_ROM_SIZE;
+        roms[i].seed = seeds[i];
+        if (!roms[i].file) {
+            perror(rom_paths[i]);
+            exit(1);
+        }
+    }
+    ret = ice40_patch(f, roms, count, o);
+    irw_close(&o);
+    irw_close(&f);
+    for (i = 0; i < count; i++)
+        irw_close(&roms[i].file);
+    return ret;
+}
+
+int main(void)
+{
+    static const uint32_t warm_seeds[ICE40_MAX_ROMS] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    static const uint32_t seeds[2] = { 1, 9 };
+    char dir[] = "/tmp/ice40-refcache.XXXXXX";
+    char top_path[64], a_path[64], b_path[64];
+    const char *warm_paths[ICE40_MAX_ROMS];
+    const char *rom_paths[2];
+    uint8_t rom_a[TEST_ROM_SIZE], rom_b[TEST_ROM_SIZE];
+    uint8_t bank_a[TEST_ROM_SIZE], bank_b[TEST_ROM_SIZE];
+    const uint8_t *banks[2] = { bank_a, bank_b };
+    struct buffer top, expected;
+    struct buffer out = { NULL, 0 };
+    int failed = 0;
+    int ret;
+    int i;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(top_path, sizeof(top_path), "%s/top.bin", dir);
+    snprintf(a_path, sizeof(a_path), "%s/a.bin", dir);
+    snprintf(b_path, sizeof(b_path), "%s/b.bin", dir);
+
+    for (i = 0; i < TEST_ROM_SIZE; i++) {
+        rom_a[i] = i * 7 + 1;
+        rom_b[i] = i * 13 + 5;
+    }
+    write_file(a_path, rom_a, sizeof(rom_a));
+    write_file(b_path, rom_b, sizeof(rom_b));
+
+    // Bank 0 holds the pattern for seed 1, and bank 1 the one for seed 9
+    sprayed_pattern(bank_a, seeds[0]);
+    sprayed_pattern(bank_b, seeds[1]);
+    build_bitstream(&top, banks, 2);
+    write_file(top_path, top.data, top.length);
+    sprayed(bank_a, rom_a);
+    sprayed(bank_b, rom_b);
+    build_bitstream(&expected, banks, 2);
+
+    // Fill every cache slot.  Most of these seeds aren't in the
+    // bitstream, so this pass is expected to fail.
+    for (i = 0; i < ICE40_MAX_ROMS; i++)
+        warm_paths[i] = a_path;
+    patch(top_path, warm_paths, warm_seeds, ICE40_MAX_ROMS, &out);
+    free(out.data);
+    out.data = NULL;
+    out.length = 0;
+
+    // Seed 1 is a cache hit, and seed 9 needs a slot
+    rom_paths[0] = a_path;
+    rom_paths[1] = b_path;
+    ret = patch(top_path, rom_paths, seeds, 2, &out);
+    if (ret) {
+        fprintf(stderr, "FAIL: patching returned %d\n", ret);
+        failed = 1;
+    }
+    else if ((out.length != expected.length) || memcmp(out.data, expected.data, out.length)) {
+        fprintf(stderr, "FAIL: patched bitstream doesn't match\n");
+        failed = 1;
+    }
+
+    unlink(top_path);
+    unlink(a_path);
+    unlink(b_path);
+    rmdir(dir);
+    free(out.data);
+    free(top.data);
+    free(expected.data);
+    if (!failed)
+        printf("PASS: ice40-refcache\n");
+    return failed;
+}
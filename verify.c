@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memscan.h"
+#include "verify.h"
+
+static void verify_close_range(struct verify_report *r) {
+    if (!r->range_open)
+        return;
+    if (!r->quiet)
+        fprintf(r->stream, "0x%08x-0x%08x: %u byte(s) differ\n",
+                r->range_start, r->range_end, r->range_errors);
+    r->range_open = 0;
+}
+
+void verifyInit(struct verify_report *r, FILE *stream, uint32_t sector_size, int quiet) {
+    memset(r, 0, sizeof(*r));
+    r->stream = stream;
+    r->sector_size = sector_size;
+    r->quiet = quiet;
+}
+
+uint32_t verifyChunk(struct verify_report *r, uint32_t addr,
+                     const uint8_t *expected, const uint8_t *actual, uint32_t len) {
+    uint32_t errors = 0;
+    uint32_t offset = 0;
+
+    while (offset < len) {
+        offset += memscanDiff(expected + offset, actual + offset, len - offset);
+        if (offset >= len)
+            break;
+
+        uint32_t bad = addr + offset;
+        if (r->range_open && (bad - r->range_end) > VERIFY_MERGE_GAP)
+            verify_close_range(r);
+        if (!r->range_open) {
+            r->range_open = 1;
+            r->range_start = bad;
+            r->range_errors = 0;
+            r->ranges++;
+        }
+        if (!r->errors)
+            r->first_bad = bad;
+        r->last_bad = bad;
+        r->range_end = bad;
+        r->range_errors++;
+        r->errors++;
+        errors++;
+        offset++;
+    }
+    return errors;
+}
+
+uint32_t verifyFinish(struct verify_report *r) {
+    verify_close_range(r);
+    if (r->errors)
+        fprintf(r->stream,
+                "verify: errors=%u ranges=%u first_bad_sector=0x%08x last_bad_sector=0x%08x\n",
+                r->errors, r->ranges,
+                r->first_bad - (r->first_bad % r->sector_size),
+                r->last_bad - (r->last_bad % r->sector_size));
+    else
+        fprintf(r->stream, "verify: errors=0 ranges=0\n");
+    return r->errors;
+}
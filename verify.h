@@ -0,0 +1,38 @@
+#ifndef FF_VERIFY_H_
+#define FF_VERIFY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Mismatches closer together than this are reported as a single range.
+#define VERIFY_MERGE_GAP 16
+
+struct verify_report {
+    uint32_t errors;        // Total number of mismatched bytes
+    uint32_t ranges;        // Number of coalesced mismatch ranges
+    uint32_t first_bad;     // Address of the first mismatched byte
+    uint32_t last_bad;      // Address of the last mismatched byte
+    uint32_t sector_size;
+    int quiet;
+    FILE *stream;
+
+    // The range currently being coalesced
+    int range_open;
+    uint32_t range_start;
+    uint32_t range_end;
+    uint32_t range_errors;
+};
+
+void verifyInit(struct verify_report *r, FILE *stream, uint32_t sector_size, int quiet);
+
+// Compare a chunk of expected data against what was read back from
+// `addr`, and return the number of mismatched bytes in this chunk.
+// Chunks must be passed in ascending address order.
+uint32_t verifyChunk(struct verify_report *r, uint32_t addr,
+                     const uint8_t *expected, const uint8_t *actual, uint32_t len);
+
+// Flush the last range and print the machine-readable summary.
+// Returns the number of mismatched bytes.
+uint32_t verifyFinish(struct verify_report *r);
+
+#endif /* FF_VERIFY_H_ */
@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "watch.h"
+
+#define WATCH_MAX_FILES 4
+
+struct ff_watch {
+    int fd;
+    int count;
+    struct {
+        int wd;
+        char *path;
+        char *name;     // Basename within the watched directory
+    } files[WATCH_MAX_FILES];
+};
+
+struct ff_watch *watchAlloc(void) {
+    struct ff_watch *w = malloc(sizeof(*w));
+    if (!w)
+        return NULL;
+    memset(w, 0, sizeof(*w));
+    w->fd = inotify_init1(IN_CLOEXEC);
+    if (w->fd == -1) {
+        perror("unable to start watching files");
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void watchFree(struct ff_watch **w) {
+    int i;
+    if (!w || !*w)
+        return;
+    for (i = 0; i < (*w)->count; i++) {
+        free((*w)->files[i].path);
+        free((*w)->files[i].name);
+    }
+    close((*w)->fd);
+    free(*w);
+    *w = NULL;
+}
+
+int watchAdd(struct ff_watch *w, const char *path) {
+    char *dir_copy;
+    char *name_copy;
+    int wd;
+
+    if (w->count >= WATCH_MAX_FILES) {
+        fprintf(stderr, "watch: too many files\n");
+        return -1;
+    }
+
+    dir_copy = strdup(path);
+    name_copy = strdup(path);
+    wd = inotify_add_watch(w->fd, dirname(dir_copy),
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE);
+    if (wd == -1) {
+        fprintf(stderr, "watch: %s: %s\n", dir_copy, strerror(errno));
+        free(dir_copy);
+        free(name_copy);
+        return -1;
+    }
+    w->files[w->count].wd = wd;
+    w->files[w->count].path = strdup(path);
+    w->files[w->count].name = strdup(basename(name_copy));
+    w->count++;
+    free(dir_copy);
+    free(name_copy);
+    return 0;
+}
+
+// Read the pending events.  Returns a mask of what happened to any of
+// the watched files, or -1 on error.
+static int watch_read(struct ff_watch *w) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    ssize_t offset;
+    int mask = 0;
+    int i;
+
+    len = read(w->fd, buf, sizeof(buf));
+    if (len <= 0) {
+        if (len < 0 && errno == EINTR)
+            return 0;
+        perror("watch");
+        return -1;
+    }
+    for (offset = 0; offset < len; ) {
+        const struct inotify_event *ev = (const struct inotify_event *)(buf + offset);
+        for (i = 0; i < w->count; i++)
+            if ((ev->wd == w->files[i].wd) && ev->len && !strcmp(ev->name, w->files[i].name))
+                mask |= ev->mask;
+        offset += sizeof(*ev) + ev->len;
+    }
+    return mask;
+}
+
+int watchWait(struct ff_watch *w, uint32_t debounce_ms) {
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+    int complete = 0;
+    int mask;
+    int i;
+
+    for (;;) {
+        // Wait indefinitely for the first complete write, then only as
+        // long as the debounce once one has been seen.
+        int ret = poll(&pfd, 1, complete ? (int)debounce_ms : -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("watch");
+            return -1;
+        }
+
+        if (ret == 0) {
+            // Quiet for long enough.  Make sure the files are really there.
+            struct stat st;
+            for (i = 0; i < w->count; i++)
+                if ((stat(w->files[i].path, &st) == -1) || !st.st_size)
+                    break;
+            if (i == w->count)
+                return 0;
+            complete = 0;
+            continue;
+        }
+
+        mask = watch_read(w);
+        if (mask < 0)
+            return -1;
+        if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+            complete = 1;
+
+        // A file being written again means it isn't finished yet
+        else if (mask & (IN_MODIFY | IN_CREATE))
+            complete = 0;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef FF_WATCH_H_
+#define FF_WATCH_H_
+
+#include <stdint.h>
+
+// Wait for this long after the last change before reloading, by default
+#define WATCH_DEBOUNCE_MS 100
+
+struct ff_watch;
+
+struct ff_watch *watchAlloc(void);
+void watchFree(struct ff_watch **w);
+
+// Watch `path` for being rewritten or replaced.  The directory is
+// watched rather than the file, since tools often write a new file and
+// rename it over the old one.
+int watchAdd(struct ff_watch *w, const char *path);
+
+// Block until a watched file has been closed after writing or renamed
+// into place, and then until nothing has touched it for `debounce_ms`.
+// Returns 0 when the file is ready, or -1 on error.
+int watchWait(struct ff_watch *w, uint32_t debounce_ms);
+
+#endif /* FF_WATCH_H_ */